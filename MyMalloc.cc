@@ -1,198 +1,4267 @@
 //
 // CS354: MyMalloc Project
 //
-// The current implementation gets memory from the OS
-// every time memory is requested and never frees memory.
+// Small objects (up to MaxSmallSize bytes) are served from slabs that
+// belong to a single thread. A slab is a page-aligned run of memory
+// carved into objects of one size class, so two threads are never handed
+// objects on the same cache line. Objects freed by a thread that does not
+// own the slab go back to the owner, in batches through a transfer cache
+// or onto the slab's remote free list, and are taken back the next time
+// it runs out of objects of that class.
 //
-// You will implement the allocator as indicated in the handout.
-// 
-// Also you will need to add the necessary locking mechanisms to
-// support multi-threaded programs.
+// Larger objects, and the slabs themselves, come from a heap of objects
+// with boundary tags: every object has a header and a footer holding its
+// size and flags, so free can coalesce an object with both neighbours in
+// constant time. The free list itself is kept in descriptors outside the
+// heap, so searching it never touches the pages of free objects, which
+// may be purged or shared with a parent process after fork. Objects
+// below FastBinMaxSize are parked in fast bins
+// instead and coalesced in bulk later. Memory is taken from the OS in
+// segments that start and end with fence posts, which keep coalescing
+// from running off a segment.
+//
+// The allocator is a template over the policies in MyMallocPolicies.h.
+// The policies picked by the MYMALLOC_* macros below decide locking,
+// statistics, checking, placement and where memory comes from.
 //
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <atomic>
+
+#include "MyMalloc.h"
+#include "MyMallocPolicies.h"
+#include "SizeClasses.h"
+
+#ifndef MYMALLOC_LOCKING
+#define MYMALLOC_LOCKING MutexLocking
+#endif
+
+#ifndef MYMALLOC_STATS
+#define MYMALLOC_STATS NoStats
+#endif
+
+#ifndef MYMALLOC_CHECKING
+#define MYMALLOC_CHECKING NoChecks
+#endif
+
+#ifndef MYMALLOC_PLACEMENT
+#define MYMALLOC_PLACEMENT FirstFit
+#endif
+
+#ifndef MYMALLOC_PAGE_SOURCE
+#define MYMALLOC_PAGE_SOURCE SbrkPageSource
+#endif
+
+// Nonzero turns the buddy heap on by default; see BuddyMinOrder
+#ifndef MYMALLOC_BUDDY
+#define MYMALLOC_BUDDY 0
+#endif
+
+// glibc before 2.33 declares only the int-sized mallinfo
+#if defined( __GLIBC__ ) && !__GLIBC_PREREQ( 2, 33 )
+struct mallinfo2 {
+  size_t arena;
+  size_t ordblks;
+  size_t smblks;
+  size_t hblks;
+  size_t hblkhd;
+  size_t usmblks;
+  size_t fsmblks;
+  size_t uordblks;
+  size_t fordblks;
+  size_t keepcost;
+};
+#endif
 
 enum {
   ObjFree = 0,
-  ObjAllocated = 1
+  ObjAllocated = 1,
+  ObjFast = 2,                // In a fast bin; the footer still says allocated
+  ObjMapped = 3               // Has a mapping of its own and no footer
+};
+
+enum {
+  AllocatedMagic = 0x77777777,
+  FreeMagic = 0x55555555
+};
+
+enum {
+  CacheLineSize = 64,
+  PageShift = 12,
+  PageSize = 1 << PageShift,
+
+  // Minimum amount of memory requested from the OS at a time
+  ArenaGrowth = 1024 * 1024
+};
+
+// Every size class keeps up to CentralListBytes of empty slabs for the
+// next thread that needs one before slabs go back to the large object
+// heap.
+//
+// Small objects freed by a thread that does not own their slab are
+// gathered in batches of the class's _batchSize whose slabs all belong
+// to one heap. Each class has a transfer cache of up to TransferBatches
+// such batches, from which the owning heap takes a whole batch at once
+// when it runs out of objects. Batches never go to another heap, so
+// objects stay with the thread that owns their slab.
+enum {
+  CentralListBytes = 512 * 1024,
+  TransferBatches = 8
+};
+
+// Besides the slab it allocates from, a heap may keep _keep[ c ] empty
+// slabs of class c instead of giving them back. _keep starts at zero,
+// grows by one when the heap needs a new slab after having given one
+// back, and shrinks by one after CacheIdleWalks slow paths of the class
+// that needed no new slab. The sizes of all _keep slabs of all heaps
+// add up to at most ThreadCacheBytes; a heap that needs more takes it
+// from the heap whose slow path ran least recently.
+//
+// A thread's cache goes back when the thread exits, and the slow path
+// of any thread that needs a new slab reclaims, at most once every
+// ThreadIdleMs, the caches of heaps that have not been in their slow
+// path for ThreadIdleMs; see scavenge.
+enum {
+  ThreadCacheBytes = 32 * 1024 * 1024,
+  CacheIdleWalks = 256,
+  ThreadIdleMs = 10000
+};
+
+// Large objects below FastBinMaxSize are freed into a LIFO per
+// FastBinStep bytes of size without being coalesced, since most are
+// allocated again soon. The bins are merged into the free list when an
+// allocation cannot be satisfied or when they hold more than
+// 1/FastBinFraction of the heap.
+enum {
+  FastBinStep = 1024,
+  FastBinMaxSize = 64 * 1024,
+  NumFastBins = FastBinMaxSize / FastBinStep,
+  FastBinFraction = 4
+};
+
+// Free objects of TreeMinSize bytes or more are also kept in a SizeTree,
+// and requests that large take the smallest that fits from it whatever
+// the placement, so workloads with many huge blocks do not walk a list
+// of them. It is below MmapThreshold, so that the tree also serves
+// requests when mmap_threshold keeps its default.
+enum {
+  TreeMinSize = 256 * 1024
+};
+
+// Under PlaceTlsf, free objects are kept in TlsfBins instead, and the
+// fast bins are not used, so that malloc and free of a large object
+// take constant time. Small objects keep their slab slow path, which is
+// not bounded. Sizes from 2^f to 2^(f+1) are split into
+// TlsfSecondLevels bins of equal width, and sizes below
+// 2^TlsfLinearShift into bins of SmallGranularity bytes.
+enum {
+  TlsfSecondBits = 4,
+  TlsfSecondLevels = 1 << TlsfSecondBits,
+  TlsfLinearShift = TlsfSecondBits + 4,
+  TlsfFirstLevels = 64 - TlsfLinearShift + 1
+};
+
+static_assert( ( 1 << TlsfLinearShift ) / TlsfSecondLevels == SmallGranularity,
+               "linear TLSF bins must be SmallGranularity apart" );
+
+// With the buddy option, objects above MaxSmallSize and below the mmap
+// threshold come from a buddy heap instead: blocks of 2^k bytes for k
+// from BuddyMinOrder to BuddyMaxOrder, aligned to their size and carved
+// from roots of the largest order. A block's buddy is found by flipping
+// bit k of its offset, and a bitmap per order says whether it is free,
+// so splitting and merging take a step per order and read no tags.
+// Blocks have no header either, so power-of-two requests fill them
+// exactly; other sizes lose up to half of their block. Free blocks keep
+// their pages until malloc_trim, since dropping them whenever a root
+// empties makes a heap that empties and fills again fault them all back.
+enum {
+  BuddyMinOrder = 15,
+  BuddyMaxOrder = 22,
+  NumBuddyOrders = BuddyMaxOrder - BuddyMinOrder + 1,
+  BuddyMinSize = 1 << BuddyMinOrder
+};
+
+static_assert( (size_t) BuddyMinSize > (size_t) MaxSmallSize,
+               "the smallest buddy block must hold any large object" );
+
+// The constants below are defaults; see Options for the settings that
+// the configuration string can change.
+
+// The buddy heap reserves BuddyReserve bytes of address space the first
+// time it is used, and takes roots from it as it grows.
+enum {
+  BuddyReserve = 1024 * 1024 * 1024
+};
+
+// Objects of MmapThreshold bytes or more get a mapping of their own.
+// Freed mappings are kept in an extent cache and reused for requests at
+// most 1/ExtentSlackFraction smaller. A cached extent is purged after
+// ExtentPurgeMs and unmapped after ExtentMaxAgeMs, or earlier when the
+// cache holds more than ExtentCacheBytes.
+enum {
+  MmapThreshold = 512 * 1024,
+  ExtentSlackFraction = 4,
+  ExtentCacheBytes = 64 * 1024 * 1024,
+  ExtentPurgeMs = 1000,
+  ExtentMaxAgeMs = 10000
+};
+
+static_assert( (size_t) TreeMinSize < (size_t) MmapThreshold,
+               "the size tree must serve some requests by default" );
+
+// When the free object at the top of the heap grows past TrimThreshold
+// after a free, the heap is shrunk so that TrimPad bytes stay free there.
+// An object freed into a free object of TrimThreshold bytes or more
+// elsewhere has its pages dropped, since the top is often pinned by a
+// later allocation.
+enum {
+  TrimThreshold = 4 * 1024 * 1024,
+  TrimPad = ArenaGrowth
+};
+
+// Lets the kernel take the pages of a cached extent when it needs them
+#ifdef MADV_FREE
+#define MYMALLOC_MADV_PURGE MADV_FREE
+#else
+#define MYMALLOC_MADV_PURGE MADV_DONTNEED
+#endif
+
+// Transparent huge page policy for memory taken from the OS
+enum {
+  ThpDefault,                 // Whatever the system does
+  ThpAlways,                  // MADV_HUGEPAGE
+  ThpNever                    // MADV_NOHUGEPAGE
+};
+
+// Settings read from the configuration string, see parseOptions. Every
+// member has a constant initialiser, so the defaults are in place before
+// any code runs and allocations that come before initialize use them.
+class Options {
+ public:
+  size_t _mmapThreshold = MmapThreshold;
+  size_t _extentCacheBytes = ExtentCacheBytes;
+  size_t _extentPurgeMs = ExtentPurgeMs;
+  size_t _extentMaxAgeMs = ExtentMaxAgeMs;
+  size_t _trimThreshold = TrimThreshold;
+  size_t _trimPad = TrimPad;
+  size_t _threadCacheBytes = ThreadCacheBytes;
+  size_t _threadIdleMs = ThreadIdleMs;
+  size_t _checkBudget = 0;    // Objects checked by every large allocation
+  size_t _buddyReserve = MYMALLOC_BUDDY ? BuddyReserve : 0; // 0 for none
+  size_t _poolBytes = 0;      // Heap set up and faulted in at startup
+  int _thp = ThpDefault;
+  int _placement = MYMALLOC_PLACEMENT::Default;
+  int _statsPrint = 1;        // Print statistics at exit
+};
+
+// Names of the placements, for the configuration and the statistics
+static const char * const placementNames[ NumPlacements ] = {
+  "first", "next", "best", "worst", "address", "tlsf"
 };
 
+// Overridden by a program that defines its own; see MyMalloc.h
+const char * mymalloc_conf __attribute__((weak)) = NULL;
+
 // Header of an object. Used both when the object is allocated and freed
 class ObjectHeader {
  public:
   int _flags;		      // flags == ObjFree or flags = ObjAllocated
-  size_t _objectSize;         // Size of the object. Used both when allocated
-			      // and freed.
+  int _magic;                 // AllocatedMagic or FreeMagic when checking
+  size_t _objectSize;         // Size of the object, including header and
+			      // footer. Used both when allocated and freed.
+};
+
+// Boundary tag at the end of every object. Lets free find the start of
+// the previous object.
+class ObjectFooter {
+ public:
+  int _flags;
+  int _unused;
+  size_t _objectSize;
+};
+
+class FreeChunk;
+
+// Start of a free large object. A coalesced one points to its free list
+// entry; one in a fast bin links to the next object of the bin.
+class FreeObjectHeader : public ObjectHeader {
+ public:
+  FreeChunk * _chunk;
+  FreeObjectHeader * _next;
+};
+
+// Free list entry of a coalesced free object. Entries are packed
+// together in a MetaPool, so walking the list reads a few cache lines of
+// entries instead of a page per free object.
+class FreeChunk {
+ public:
+  ObjectHeader * _object;
+  size_t _objectSize;
+  FreeChunk * _next;
+  FreeChunk * _prev;
+  FreeChunk * _left;          // In the SizeTree, if TreeMinSize or larger,
+  FreeChunk * _right;         // or previous and next in a TlsfBins list
+};
+
+// Two-level segregated fit index of free chunks. A bit per first level
+// says whether any of its bins has a chunk and a bit per bin whether it
+// has one, so finding a bin whose every chunk is large enough takes two
+// bit scans. Chunks are linked through _left and _right.
+class TlsfBins {
+  uint64_t _firstMap;
+  uint32_t _secondMap[ TlsfFirstLevels ];
+  FreeChunk * _bins[ TlsfFirstLevels ][ TlsfSecondLevels ];
+
+ public:
+  // Bin that holds chunks of size bytes
+  static void map( size_t size, int & first, int & second ) {
+    if ( size < ( (size_t) 1 << TlsfLinearShift ) ) {
+      first = 0;
+      second = size / SmallGranularity;
+      return;
+    }
+    int top = 63 - __builtin_clzll( size );
+    first = top - TlsfLinearShift + 1;
+    second = ( size >> ( top - TlsfSecondBits ) ) - TlsfSecondLevels;
+  }
+
+  void insert( FreeChunk * c ) {
+    int first;
+    int second;
+    map( c->_objectSize, first, second );
+    c->_left = NULL;
+    c->_right = _bins[ first ][ second ];
+    if ( c->_right ) {
+      c->_right->_left = c;
+    }
+    _bins[ first ][ second ] = c;
+    _secondMap[ first ] |= 1u << second;
+    _firstMap |= 1ull << first;
+  }
+
+  void remove( FreeChunk * c ) {
+    int first;
+    int second;
+    map( c->_objectSize, first, second );
+    if ( c->_left ) {
+      c->_left->_right = c->_right;
+    }
+    else {
+      _bins[ first ][ second ] = c->_right;
+      if ( c->_right == NULL ) {
+        _secondMap[ first ] &= ~( 1u << second );
+        if ( _secondMap[ first ] == 0 ) {
+          _firstMap &= ~( 1ull << first );
+        }
+      }
+    }
+    if ( c->_right ) {
+      c->_right->_left = c->_left;
+    }
+  }
+
+  // First chunk of the first non-empty bin whose smallest size is at
+  // least size. Failing that, the first chunk of size's own bin if it is
+  // large enough, which is where the heap puts memory it has just grown
+  // by; other chunks of that bin are never looked at, which is the price
+  // of never walking a list. Returns NULL if neither fits
+  FreeChunk * fit( size_t size ) const {
+    size_t rounded = size + SmallGranularity - 1;
+    if ( size >= ( (size_t) 1 << TlsfLinearShift ) ) {
+      rounded =
+        size + ( (size_t) 1 << ( 63 - __builtin_clzll( size ) - TlsfSecondBits ) ) - 1;
+    }
+    int first;
+    int second;
+    if ( rounded >= size ) {
+      map( rounded, first, second );
+      uint32_t seconds = _secondMap[ first ] & ( ~0u << second );
+      uint64_t firsts = first + 1 < 64 ? _firstMap & ( ~0ull << ( first + 1 ) ) : 0;
+      if ( seconds ) {
+        return _bins[ first ][ __builtin_ctz( seconds ) ];
+      }
+      if ( firsts ) {
+        first = __builtin_ctzll( firsts );
+        return _bins[ first ][ __builtin_ctz( _secondMap[ first ] ) ];
+      }
+    }
+    map( size, first, second );
+    FreeChunk * c = _bins[ first ][ second ];
+    return c && c->_objectSize >= size ? c : NULL;
+  }
+
+  FreeChunk * head( int first, int second ) const {
+    return _bins[ first ][ second ];
+  }
+  bool marked( int first, int second ) const {
+    return ( _secondMap[ first ] >> second ) & 1;
+  }
+  bool marked( int first ) const {
+    return ( _firstMap >> first ) & 1;
+  }
+};
+
+// Link stored at the start of a free block of the buddy heap
+class BuddyBlock {
+ public:
+  BuddyBlock * _next;
+  BuddyBlock * _prev;
+};
+
+// Free chunks of TreeMinSize bytes or more, indexed by size and then
+// address in a treap. A chunk's priority is a hash of its entry's
+// address, so the shape is random without storing anything, and the
+// expected depth is logarithmic. The recursion below is as deep as the
+// tree.
+class SizeTree {
+  FreeChunk * _root;
+
+  static uint32_t priority( const FreeChunk * c ) {
+    return ( (uintptr_t) c * 0x9e3779b97f4a7c15ull ) >> 32;
+  }
+  static bool before( const FreeChunk * a, const FreeChunk * b ) {
+    return a->_objectSize < b->_objectSize ||
+           ( a->_objectSize == b->_objectSize && a->_object < b->_object );
+  }
+
+  static FreeChunk * insert( FreeChunk * t, FreeChunk * c ) {
+    if ( t == NULL ) {
+      c->_left = NULL;
+      c->_right = NULL;
+      return c;
+    }
+    if ( before( c, t ) ) {
+      t->_left = insert( t->_left, c );
+      if ( priority( t->_left ) > priority( t ) ) {
+        FreeChunk * l = t->_left;
+        t->_left = l->_right;
+        l->_right = t;
+        return l;
+      }
+    }
+    else {
+      t->_right = insert( t->_right, c );
+      if ( priority( t->_right ) > priority( t ) ) {
+        FreeChunk * r = t->_right;
+        t->_right = r->_left;
+        r->_left = t;
+        return r;
+      }
+    }
+    return t;
+  }
+
+  // Joins two treaps whose keys are all in a before those in b
+  static FreeChunk * join( FreeChunk * a, FreeChunk * b ) {
+    if ( a == NULL ) {
+      return b;
+    }
+    if ( b == NULL ) {
+      return a;
+    }
+    if ( priority( a ) > priority( b ) ) {
+      a->_right = join( a->_right, b );
+      return a;
+    }
+    b->_left = join( a, b->_left );
+    return b;
+  }
+
+  static FreeChunk * remove( FreeChunk * t, FreeChunk * c ) {
+    if ( t == c ) {
+      return join( c->_left, c->_right );
+    }
+    if ( before( c, t ) ) {
+      t->_left = remove( t->_left, c );
+    }
+    else {
+      t->_right = remove( t->_right, c );
+    }
+    return t;
+  }
+
+ public:
+  void insert( FreeChunk * c ) { _root = insert( _root, c ); }
+  void remove( FreeChunk * c ) { _root = remove( _root, c ); }
+  FreeChunk * root() const { return _root; }
+
+  // Smallest chunk of at least size bytes, the lowest one of equal
+  // chunks, or NULL. Adds the chunks it looks at to steps
+  FreeChunk * fit( size_t size, size_t & steps ) const {
+    FreeChunk * best = NULL;
+    for ( FreeChunk * t = _root; t; ) {
+      steps++;
+      if ( t->_objectSize >= size ) {
+        best = t;
+        t = t->_left;
+      }
+      else {
+        t = t->_right;
+      }
+    }
+    return best;
+  }
+
+  // Largest chunk, or NULL
+  FreeChunk * largest( size_t & steps ) const {
+    FreeChunk * t = _root;
+    while ( t && t->_right ) {
+      steps++;
+      t = t->_right;
+    }
+    return t;
+  }
+};
+
+enum {
+  ObjectOverhead = sizeof(ObjectHeader) + sizeof(ObjectFooter),
+  MinObjectSize = sizeof(FreeObjectHeader) + sizeof(ObjectFooter)
+};
+
+// Link stored inside a free small object
+class FreeObject {
+ public:
+  FreeObject * _next;
+};
+
+class ThreadHeap;
+
+// Descriptor of a slab. It lives outside the slab so that the objects
+// start right at the page boundary, and it is cache-line aligned because
+// the owner and remote freeing threads both write to it.
+class alignas(CacheLineSize) Slab {
+ public:
+  ThreadHeap * _owner;                   // Heap that allocates from the slab
+  char * _start;                         // First byte of the slab
+  Slab * _next;                          // Next slab of the owner's class list
+  FreeObject * _freeList;                // Objects freed by the owner
+  std::atomic<FreeObject *> _remoteFree; // Objects freed by other threads
+  size_t _objectSize;
+  int _sizeClass;
+  int _capacity;                         // # objects that fit in the slab
+  int _carved;                           // # objects handed out at least once
+  int _used;                             // # objects not on the owner's lists
+  Slab * _nextAll;                       // All slabs in use, for checkHeap
+  Slab * _prevAll;
+  std::atomic<int> _full;                // Off the owner's list; see markFull
+  Slab * _nextReturned;                  // In the owner's _returned list
+};
+
+// Per-thread allocation state. Every slab in _slabs[c] is owned by this
+// heap; the first slab of each list is the one the fast path uses. Slabs
+// that were found full are on no list until an object in them is freed,
+// which puts them in _returned.
+//
+// The owner changes the lists only while holding _busy, except that it
+// may free into any slab and push a slab in front, so the scavenger can
+// take empty slabs past the first ones while it holds _busy itself.
+class alignas(CacheLineSize) ThreadHeap {
+ public:
+  Slab * _slabs[ NumSizeClasses ];
+  std::atomic<int> _busy;
+  ThreadHeap * _nextAbandoned;
+  ThreadHeap * _nextHeap;                // All heaps ever created
+  size_t _counters[ NumCallKinds ];      // Used by PerThreadStats
+  int _abandoned;                        // Its thread has exited
+
+  // Objects of slabs of _remoteOwner[ c ], freed here and not yet handed
+  // to the transfer cache, and objects of this heap's slabs that other
+  // heaps freed, taken back from the transfer cache and not yet
+  // allocated. Their slabs count them as used.
+  FreeObject * _remote[ NumSizeClasses ];
+  FreeObject * _borrowed[ NumSizeClasses ];
+  ThreadHeap * _remoteOwner[ NumSizeClasses ];
+  int _remoteCount[ NumSizeClasses ];
+
+  // Empty slabs kept per class; see ThreadCacheBytes. _keep and
+  // _cacheBytes, the bytes _keep stands for, change only under the
+  // allocator lock since other heaps take from them.
+  int _keep[ NumSizeClasses ];
+  int _released[ NumSizeClasses ];       // Slabs given back since a miss
+  int _walks[ NumSizeClasses ];          // Slow paths since a miss
+  size_t _cacheBytes;
+  uint64_t _lastActive;                  // nowMs() of the last slow path
+
+  // Pushed by other threads, so kept off the lines the owner reads
+  alignas(CacheLineSize) std::atomic<Slab *> _returned[ NumSizeClasses ];
+};
+
+// Memory obtained from the OS in one piece. Starts with a footer and
+// ends with a header that are marked allocated (the fence posts).
+class Segment {
+ public:
+  char * _start;
+  char * _end;
+  Segment * _next;
+};
+
+// A freed mapping kept in the extent cache. The descriptor lives outside
+// the mapping because purging may drop its contents.
+class Extent {
+ public:
+  char * _start;
+  size_t _size;
+  uint64_t _freedAt;                     // nowMs() when it was cached
+  int _purged;
+  Extent * _next;                        // Toward older extents
+  Extent * _prev;
+};
+
+// Errors found by a heap check while the lock is held. They are handed
+// to the callback once the lock is released, so the callback may use
+// malloc.
+class CheckReport {
+ public:
+  enum { MaxErrors = 16 };
+
+  const char * _messages[ MaxErrors ];
+  const void * _addresses[ MaxErrors ];
+  size_t _count;
+
+  CheckReport() : _count( 0 ) {}
+
+  void add( const char * message, const void * address ) {
+    if ( _count < MaxErrors ) {
+      _messages[ _count ] = message;
+      _addresses[ _count ] = address;
+    }
+    _count++;
+  }
+};
+
+// What mallinfo2 and malloc_info report, filled in by getInfo
+class HeapInfo {
+ public:
+  size_t _heapSize;
+  size_t _maxHeapSize;
+  size_t _freeBytes;                     // In the free list
+  size_t _freeCount;
+  size_t _fastBytes;                     // In the fast bins
+  size_t _fastCount;
+  size_t _topFree;                       // Free top that trim can release
+  size_t _mappedBytes;                   // Large objects in own mappings
+  size_t _mappedCount;
+  size_t _cachedBytes;                   // Extent cache
+  size_t _cachedCount;
+  size_t _slabBytes;                     // Slabs, including free objects
+  size_t _slabCount;
+  size_t _slabFreeBytes;
+  size_t _classFree[ NumSizeClasses ];   // Free small objects per class
+  size_t _threadCacheBytes;              // Thread cache budget in use
+  size_t _threadCacheBudget;
+  size_t _buddyBytes;                    // Roots of the buddy heap
+  size_t _buddyFreeBytes;
+  size_t _buddyFreeCount;
+};
+
+// Maps every page that belongs to a slab to its descriptor. Other pages
+// map to NULL. Two levels cover a 48-bit address space; leaves are
+// mmapped the first time a page in their range is registered.
+class PageMap {
+  enum {
+    LeafBits = 18,
+    RootBits = 48 - PageShift - LeafBits
+  };
+
+  std::atomic<Slab **> _root[ 1 << RootBits ];
+
+public:
+  Slab * lookup( const void * ptr ) {
+    uintptr_t page = (uintptr_t) ptr >> PageShift;
+    if ( ( page >> LeafBits ) >= ( 1ul << RootBits ) ) {
+      return NULL;
+    }
+    Slab ** leaf = _root[ page >> LeafBits ].load( std::memory_order_acquire );
+    return leaf ? leaf[ page & ( ( 1 << LeafBits ) - 1 ) ] : NULL;
+  }
+
+  // Must be called with the allocator lock held
+  bool set( const void * start, size_t size, Slab * slab );
+};
+
+// Hands out descriptors from mmapped chunks, packed as closely as the
+// alignment of T allows, and keeps released ones for reuse. Never calls
+// malloc. Callers hold the lock.
+template <class T>
+class MetaPool {
+  enum { ChunkSize = 64 * 1024 };
+
+  union alignas(T) Item {
+    Item * _next;
+    char _bytes[ sizeof(T) ];
+  };
+
+  Item * _free;
+  char * _bump;
+  char * _end;
+
+  // Chunks mapped so far, linked through their first item
+  Item * _chunks;
+
+public:
+  T * get() {
+    Item * item = _free;
+    if ( item ) {
+      _free = item->_next;
+    }
+    else {
+      if ( _bump + sizeof(Item) > _end ) {
+        void * chunk = mmap( NULL, ChunkSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( chunk == MAP_FAILED ) {
+          return NULL;
+        }
+        Item * first = (Item *) chunk;
+        first->_next = _chunks;
+        _chunks = first;
+        _bump = (char *) ( first + 1 );
+        _end = (char *) chunk + ChunkSize;
+      }
+      item = (Item *) _bump;
+      _bump += sizeof(Item);
+    }
+    memset( item, 0, sizeof(Item) );
+    return (T *) item;
+  }
+
+  void put( T * t ) {
+    Item * item = (Item *) t;
+    item->_next = _free;
+    _free = item;
+  }
+
+  // Maps and faults in enough chunks that the next count calls to get
+  // take a released item
+  void reserve( size_t count ) {
+    Item * taken = NULL;
+    for ( size_t i = 0; i < count; i++ ) {
+      Item * item = (Item *) get();
+      if ( item == NULL ) {
+        break;
+      }
+      item->_next = taken;
+      taken = item;
+    }
+    while ( taken ) {
+      Item * next = taken->_next;
+      put( (T *) taken );
+      taken = next;
+    }
+  }
+
+  // True if p is the address of an item of the pool, in use or not.
+  // For heap checks, which must not follow a corrupt pointer
+  bool owns( const void * p ) const {
+    for ( Item * chunk = _chunks; chunk; chunk = chunk->_next ) {
+      uintptr_t offset = (uintptr_t) p - (uintptr_t) chunk;
+      if ( offset >= sizeof(Item) && offset + sizeof(Item) <= ChunkSize &&
+           offset % sizeof(Item) == 0 ) {
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
-class Allocator {
+// Reports a heap corruption found by a checking policy and aborts.
+// Formats by hand because stdio may allocate.
+static void
+checkFailed( const char * message, const void * ptr )
+{
+  char buffer[ 128 ];
+  int n = 0;
+  const char * prefix = "MyMalloc: ";
+  while ( *prefix ) buffer[ n++ ] = *prefix++;
+  while ( *message && n < 100 ) buffer[ n++ ] = *message++;
+  buffer[ n++ ] = ' ';
+  buffer[ n++ ] = '0';
+  buffer[ n++ ] = 'x';
+  for ( int shift = 60; shift >= 0; shift -= 4 ) {
+    buffer[ n++ ] = "0123456789abcdef"[ ( (uintptr_t) ptr >> shift ) & 15 ];
+  }
+  buffer[ n++ ] = '\n';
+  if ( write( 2, buffer, n ) < 0 ) {
+    // Nothing else we can do
+  }
+  abort();
+}
+
+// Milliseconds on a clock that is cheap to read, for ageing caches
+static uint64_t
+nowMs()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+template <class P>
+class AllocatorT {
+  typedef typename P::Locking Locking;
+  typedef typename P::Stats Stats;
+  typedef typename P::Checking Checking;
+  typedef typename P::PageSource PageSource;
+
   // State of the allocator
 
-  // Size of the heap
+  // Size of the heap, and the largest it has been
   size_t _heapSize;
+  size_t _maxHeapSize;
 
-  // True if heap has been initialized
+  // True once initialize has run. Only the slow path of threadHeap
+  // looks at it; everything else works from the zero-filled state
   int _initialized;
 
-  // Verbose mode
-  int _verbose;
+  // The page heap lock. Protects sbrk, the large object free list, the
+  // page map, the descriptor pools and the lists of heaps
+  typename Locking::Lock _lock;
+
+  // Empty slabs of one size class, still carved. Each list is on its own
+  // cache line with its own lock, or is lock free in the lock-free
+  // build, so threads that need slabs of different classes never wait
+  // for each other, and the page heap lock is taken only to make a slab
+  // or to give one back. No thread holds a central list lock and _lock
+  // at the same time. _bytes may overshoot CentralListBytes by what
+  // threads push at the same moment.
+  class alignas(CacheLineSize) CentralList {
+   public:
+    typename Locking::template Stack<Slab> _slabs;
+    std::atomic<size_t> _bytes;
+  };
+
+  CentralList _central[ NumSizeClasses ];
+
+  // Batches of freed small objects, linked through _next, and the heap
+  // that owns the slabs of each; see TransferBatches. The lock is held
+  // only to move a few batch pointers.
+  class alignas(CacheLineSize) TransferCache {
+   public:
+    typename Locking::Lock _lock;
+    int _count;                          // Stored atomically; see takeBatch
+    FreeObject * _batches[ TransferBatches ];
+    ThreadHeap * _owners[ TransferBatches ];
+  };
+
+  TransferCache _transfer[ NumSizeClasses ];
+
+  // Calls pthread_setspecific so that threadExitHandler runs on exit
+  pthread_key_t _heapKey;
+
+  PageMap _pageMap;
+  MetaPool<Slab> _slabPool;
+  MetaPool<ThreadHeap> _heapPool;
+  MetaPool<Segment> _segmentPool;
+  MetaPool<Extent> _extentPool;
+  MetaPool<FreeChunk> _chunkPool;
+
+  // Free large objects. Sorted by address for PlaceAddress, otherwise
+  // newest first; coalescing uses the boundary tags
+  FreeChunk * _freeList;
+  size_t _freeBytes;
+  size_t _freeCount;
+
+  // The free list's chunks of TreeMinSize or more, or with PlaceTlsf
+  // every chunk in _bins
+  SizeTree _tree;
+  TlsfBins _bins;
+
+  // Where the next PlaceNext search starts
+  FreeChunk * _rover;
+
+  // Free list searches and the chunks they looked at
+  size_t _searches;
+  size_t _searchSteps;
+
+  // The buddy heap, in _buddyReserved bytes from _buddyStart of which
+  // the first _buddySize are roots. _buddyOrders has the order of the
+  // allocated block starting at each BuddyMinSize boundary, or 0, and
+  // bit i of _buddyBits[ k ] is set when block i of order
+  // BuddyMinOrder + k is free. Bit k of _buddyNonEmpty is set when
+  // _buddyLists[ k ] is not empty. Both live in a mapping of their own
+  char * _buddyStart;
+  size_t _buddyReserved;
+  size_t _buddySize;
+  uint8_t * _buddyOrders;
+  uint64_t * _buddyBits[ NumBuddyOrders ];
+  BuddyBlock * _buddyLists[ NumBuddyOrders ];
+  unsigned _buddyNonEmpty;
+  size_t _buddyFreeBytes;
+  size_t _buddyFreeCount;
+
+  // Buddy heap statistics. _buddyRequested and _buddyGranted add up the
+  // sizes asked for and the sizes of the blocks given out
+  size_t _buddyAllocs;
+  size_t _buddySplits;
+  size_t _buddyMerges;
+  size_t _buddyRequested;
+  size_t _buddyGranted;
+
+  // Freed large objects not coalesced yet, linked through _next
+  FreeObjectHeader * _fastBins[ NumFastBins ];
+  size_t _fastBytes;
+  size_t _fastCount;
+
+  // Segments in the order they were obtained
+  Segment * _segments;
+  Segment * _lastSegment;
+
+  // Slabs in use, for checkHeap and getInfo
+  Slab * _allSlabs;
+  size_t _slabCount;
+  size_t _slabBytes;
+
+  // Where checkHeapIncremental resumes. _checkObject is moved when the
+  // object it points to is coalesced into its left neighbour
+  Segment * _checkSegment;
+  ObjectHeader * _checkObject;
+  Slab * _checkSlab;
+
+  HeapCheckCallback _checkCallback;
+  void * _checkCallbackArg;
+
+  // Freed mappings, newest first, and the bytes they hold
+  Extent * _extents;
+  Extent * _oldestExtent;
+  size_t _cachedBytes;
+  size_t _cachedCount;
+
+  // Mappings of live large objects. Updated without the lock, since
+  // a new mapping is made after releasing it
+  std::atomic<size_t> _mappedBytes;
+  std::atomic<size_t> _mappedCount;
+
+  // Extent cache statistics
+  size_t _extentHits;
+  size_t _extentMisses;
+  size_t _extentPurges;
+  size_t _extentUnmaps;
+
+  // Heaps of threads that exited, adopted by new threads
+  ThreadHeap * _abandonedHeaps;
+
+  // Every heap ever created, for statistics
+  ThreadHeap * _allHeaps;
+
+  // Sum of the heaps' _cacheBytes
+  size_t _threadCacheBytes;
+
+  // nowMs() of the last scavenge
+  std::atomic<uint64_t> _lastScavenge;
+
+  // Heap of the calling thread
+  static __thread ThreadHeap * _threadHeap
+    __attribute__((tls_model("initial-exec")));
+
+  // Settings. Not part of the zero-filled state
+  static Options _options;
+
+  // Returns the heap of the calling thread, creating it if needed
+  ThreadHeap * threadHeap();
+
+  // Allocates a small object of class sizeClass when the first slab of
+  // the class has no free object
+  void * allocateSmallSlow( ThreadHeap * heap, int sizeClass );
+
+  // Takes back objects freed by other threads. Returns true if the slab
+  // has a free object afterwards
+  bool collectRemoteFrees( Slab * slab );
+
+  // Moves a batch of never-used objects to the slab's free list
+  void carve( Slab * slab );
+
+  // Marks a slab with no free object as full before the owner takes it
+  // off its list. Returns false if an object was freed into it meanwhile
+  // and the slab must stay
+  static bool markFull( Slab * slab ) {
+    slab->_full.store( 1, std::memory_order_seq_cst );
+    if ( slab->_remoteFree.load( std::memory_order_seq_cst ) == NULL ) {
+      return true;
+    }
+    // Whoever clears the flag is responsible for the slab
+    return slab->_full.exchange( 0, std::memory_order_seq_cst ) == 0;
+  }
+
+  // Called by another thread after freeing into a slab that was full.
+  // Hands the slab back to its owner
+  static void returnSlab( Slab * slab ) {
+    if ( slab->_full.exchange( 0, std::memory_order_acq_rel ) == 0 ) {
+      return;
+    }
+    std::atomic<Slab *> & list = slab->_owner->_returned[ slab->_sizeClass ];
+    Slab * head = list.load( std::memory_order_relaxed );
+    do {
+      slab->_nextReturned = head;
+    } while ( !list.compare_exchange_weak( head, slab,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed ) );
+  }
+
+  // Puts an object on the remote free list of its slab
+  static void freeRemote( Slab * slab, FreeObject * o ) {
+    // Sequentially consistent so that either this thread sees the
+    // slab marked full or the owner sees this object; see markFull
+    FreeObject * head = slab->_remoteFree.load( std::memory_order_relaxed );
+    do {
+      o->_next = head;
+    } while ( !slab->_remoteFree.compare_exchange_weak(
+                head, o, std::memory_order_seq_cst,
+                std::memory_order_relaxed ) );
+    if ( slab->_full.load( std::memory_order_seq_cst ) ) {
+      returnSlab( slab );
+    }
+  }
+
+  // Frees every object of a list, linked through _next, into its slab
+  void freeRemoteList( FreeObject * list );
+
+  // Hands the batch in heap->_remote[ sizeClass ] to the transfer cache
+  // for its owner. When the cache is full, the oldest batch goes back to
+  // the remote free lists of its slabs instead
+  void flushRemote( ThreadHeap * heap, int sizeClass );
+
+  // Takes a batch of objects of heap's own slabs from the transfer
+  // cache, or returns NULL
+  FreeObject * takeBatch( ThreadHeap * heap, int sizeClass );
+
+  // Serialise the owner's slow path with the scavenger. No-ops when
+  // there is only one thread
+  static void lockHeap( ThreadHeap * heap ) {
+    while ( Locking::ThreadSafe &&
+            heap->_busy.exchange( 1, std::memory_order_acquire ) ) {
+      sched_yield();
+    }
+  }
+  static bool tryLockHeap( ThreadHeap * heap ) {
+    return !Locking::ThreadSafe ||
+           heap->_busy.exchange( 1, std::memory_order_acquire ) == 0;
+  }
+  static void unlockHeap( ThreadHeap * heap ) {
+    heap->_busy.store( 0, std::memory_order_release );
+  }
+
+  // Gives back the empty slabs of a heap and its thread cache budget.
+  // With all, which only the owner may ask for when its thread exits,
+  // or the child after fork for the threads that did not survive it,
+  // also the first slab of each class if empty, and the batches in
+  // _remote go to the transfer cache. _borrowed stays with the heap: its
+  // objects belong to the heap's own slabs, so the thread that adopts
+  // the heap allocates them. Called with the heap locked
+  void releaseCache( ThreadHeap * heap, bool all );
+
+  // Reclaims the caches of idle heaps other than self; see ThreadIdleMs
+  void scavenge( ThreadHeap * self );
+
+  // Let a heap keep one more or one fewer empty slab of a class; see
+  // ThreadCacheBytes. Called without _lock
+  void growCache( ThreadHeap * heap, int sizeClass );
+  void shrinkCache( ThreadHeap * heap, int sizeClass );
+
+  // Takes thread cache budget from the least recently active heaps
+  // other than thief until bytes more fit. Called with _lock held
+  void stealCache( ThreadHeap * thief, size_t bytes );
+  void dropKeep( ThreadHeap * heap, int sizeClass );
+
+  // Gets an empty slab from the central list of its class or, when
+  // that has none, from the large object heap
+  Slab * getSlab( ThreadHeap * owner, int sizeClass );
+
+  // Puts a list of empty slabs of one class, linked through _next, on
+  // the central list of the class in one step. Those that do not fit go
+  // back to the large object heap
+  void releaseSlabs( Slab * list );
+  void destroySlab( Slab * slab );
+
+  // Allocates a large object with its address aligned to alignment
+  void * allocateLarge( size_t size, size_t alignment );
+
+  // Returns a large object to the free list, coalescing it with free
+  // neighbours. Called with _lock held
+  ObjectHeader * freeLarge( ObjectHeader * o );
+
+  // Adds memory from the OS to the free list. Called with _lock held
+  bool growHeap( size_t size );
+
+  // The buddy heap. allocateBuddy returns NULL when size needs a block
+  // larger than a root or the reserved space is used up, and the caller
+  // falls back to allocateLarge
+  bool inBuddy( const void * ptr ) {
+    return (uintptr_t) ptr - (uintptr_t) _buddyStart <
+           __atomic_load_n( &_buddyReserved, __ATOMIC_ACQUIRE );
+  }
+  void * allocateBuddy( size_t size );
+  void freeBuddy( void * ptr );
+
+  // Reserves the address space and makes the next root a free block.
+  // Called with _lock held
+  bool growBuddy();
+
+  // Bit of the block at offset in the bitmap of order BuddyMinOrder + k
+  uint64_t & buddyWord( int k, size_t offset ) {
+    return _buddyBits[ k ][ ( offset >> ( BuddyMinOrder + k ) ) / 64 ];
+  }
+  static uint64_t buddyBit( int k, size_t offset ) {
+    return 1ull << ( ( offset >> ( BuddyMinOrder + k ) ) % 64 );
+  }
+
+  // Free list and bitmap maintenance. Called with _lock held
+  void pushBuddy( char * block, int k ) {
+    BuddyBlock * b = (BuddyBlock *) block;
+    b->_prev = NULL;
+    b->_next = _buddyLists[ k ];
+    if ( b->_next ) {
+      b->_next->_prev = b;
+    }
+    _buddyLists[ k ] = b;
+    _buddyNonEmpty |= 1u << k;
+    buddyWord( k, block - _buddyStart ) |= buddyBit( k, block - _buddyStart );
+    _buddyFreeBytes += (size_t) BuddyMinSize << k;
+    _buddyFreeCount++;
+  }
+  void unlinkBuddy( BuddyBlock * b, int k ) {
+    if ( b->_prev ) {
+      b->_prev->_next = b->_next;
+    }
+    else {
+      _buddyLists[ k ] = b->_next;
+      if ( b->_next == NULL ) {
+        _buddyNonEmpty &= ~( 1u << k );
+      }
+    }
+    if ( b->_next ) {
+      b->_next->_prev = b->_prev;
+    }
+    size_t offset = (char *) b - _buddyStart;
+    buddyWord( k, offset ) &= ~buddyBit( k, offset );
+    _buddyFreeBytes -= (size_t) BuddyMinSize << k;
+    _buddyFreeCount--;
+  }
+
+  // Coalesces every object in the fast bins into the free list. Called
+  // with _lock held
+  void consolidateFastBins();
+
+  // Allocates an object of _mmapThreshold bytes or more in a mapping of
+  // its own, reusing a cached extent when one is close in size
+  void * allocateMapped( size_t size );
+  void freeMapped( ObjectHeader * o );
+
+  // Takes extents that are too old or over the byte budget out of the
+  // cache and returns them, and purges those idle for _extentPurgeMs.
+  // Called with _lock held
+  Extent * decayExtents();
+
+  // Unmaps the extents returned by decayExtents. Called without _lock
+  void unmapExtents( Extent * list );
+
+  void unlinkExtent( Extent * e );
+
+  // Shrinks the last segment so that at most pad bytes stay free at its
+  // top. Returns the number of bytes given back. Called with _lock held
+  size_t trimTop( size_t pad );
+
+  // Size of the free object at the top of the last segment, or 0
+  size_t topFreeSize() {
+    if ( _lastSegment == NULL ) {
+      return 0;
+    }
+    ObjectFooter * f =
+      (ObjectFooter *) ( _lastSegment->_end - sizeof(ObjectHeader) ) - 1;
+    return f->_flags == ObjFree ? f->_objectSize : 0;
+  }
+
+  // Applies the thp setting to the whole pages of memory just obtained
+  // from the OS
+  static void adviseHugePages( void * mem, size_t size ) {
+#ifdef MADV_HUGEPAGE
+    if ( _options._thp != ThpDefault ) {
+      uintptr_t first = ( (uintptr_t) mem + PageSize - 1 ) &
+                        ~(uintptr_t) ( PageSize - 1 );
+      uintptr_t last = ( (uintptr_t) mem + size ) & ~(uintptr_t) ( PageSize - 1 );
+      if ( first < last ) {
+        madvise( (void *) first, last - first,
+                 _options._thp == ThpAlways ? MADV_HUGEPAGE : MADV_NOHUGEPAGE );
+      }
+    }
+#else
+    (void) mem;
+    (void) size;
+#endif
+  }
+
+  // Drops the whole pages inside free objects with MADV_DONTNEED.
+  // Returns the number of bytes dropped. Called with _lock held
+  size_t purgeFreePages();
+
+  // Drops the whole pages between start and end. Returns their size
+  static size_t purgePages( char * start, char * end ) {
+    uintptr_t first = ( (uintptr_t) start + PageSize - 1 ) &
+                      ~(uintptr_t) ( PageSize - 1 );
+    uintptr_t last = (uintptr_t) end & ~(uintptr_t) ( PageSize - 1 );
+    if ( first >= last ||
+         madvise( (void *) first, last - first, MADV_DONTNEED ) != 0 ) {
+      return 0;
+    }
+    return last - first;
+  }
+
+  // Puts a large object in its fast bin. Called with _lock held
+  void pushFast( ObjectHeader * o ) {
+    size_t size = o->_objectSize;
+    FreeObjectHeader * f = (FreeObjectHeader *) o;
+    f->_flags = ObjFast;
+    if ( Checking::Magic ) {
+      f->_magic = FreeMagic;
+    }
+    f->_next = _fastBins[ size / FastBinStep ];
+    _fastBins[ size / FastBinStep ] = f;
+    _fastBytes += size;
+    _fastCount++;
+  }
+
+  // Free list maintenance. Called with _lock held
+  void insertFree( ObjectHeader * o, size_t size );
+  void removeFree( FreeChunk * chunk );
+
+  // Adds a free list entry to the index of the placement, or takes it
+  // out. Called with _lock held
+  void indexChunk( FreeChunk * chunk ) {
+    if ( _options._placement == PlaceTlsf ) {
+      _bins.insert( chunk );
+    }
+    else if ( chunk->_objectSize >= TreeMinSize ) {
+      _tree.insert( chunk );
+    }
+  }
+  void unindexChunk( FreeChunk * chunk ) {
+    if ( _options._placement == PlaceTlsf ) {
+      _bins.remove( chunk );
+    }
+    else if ( chunk->_objectSize >= TreeMinSize ) {
+      _tree.remove( chunk );
+    }
+  }
+
+  // Moves every free list entry from the index of placement to that of
+  // the current one. Called with _lock held
+  void reindexFree( int placement );
+
+  // Grows the heap by the pool option and faults its pages in, together
+  // with the free list entries it may need, so that large allocations
+  // that fit in it make no system call
+  void setUpPool();
+
+  // Returns a free chunk of at least size bytes chosen by the placement
+  // option, or NULL. Called with _lock held
+  FreeChunk * findFree( size_t size );
+
+  static FreeChunk * chunkOf( ObjectHeader * o ) {
+    return ( (FreeObjectHeader *) o )->_chunk;
+  }
+
+  void checkSmallFree( Slab * slab, void * ptr );
+  void checkLargeFree( ObjectHeader * o );
+
+  // Heap verification. The check functions add what they find to report.
+  // checkSlab skips the page map when address, the slab's own address,
+  // is NULL
+  bool inSegment( const void * ptr );
+  ObjectHeader * checkObject( Segment * segment, ObjectHeader * o,
+                              CheckReport & report );
+  void checkSlab( const Slab * slab, const Slab * address, bool walkLists,
+                  CheckReport & report );
+  bool ownsLists( const Slab * slab );
+
+  // Checks the subtree at t, whose keys lie between low and high (either
+  // may be NULL), adding its chunks to nodes. Stops once nodes passes
+  // limit, so a cycle cannot recurse forever
+  void checkTree( FreeChunk * t, const FreeChunk * low,
+                  const FreeChunk * high, size_t & nodes, size_t limit,
+                  CheckReport & report );
+  void checkBuddy( CheckReport & report );
+
+  // Checks that the TLSF bins hold the listed free list entries, each in
+  // the bin of its size, and that the bitmaps match the bins
+  void checkBins( size_t listed, CheckReport & report );
+
+  // Hands the errors in report to the callback, or aborts on the first
+  // one when there is none. Called without _lock
+  size_t deliver( CheckReport & report );
+
+  // A free needs no heap, so it does not adopt one for the counters
+  // either: libc frees after the thread exit handler has run, and a heap
+  // adopted then would never be abandoned again
+  void countCall( int kind ) {
+    if ( Stats::Enabled ) {
+      ThreadHeap * heap = kind == FreeCall ? _threadHeap : threadHeap();
+      if ( heap ) {
+        Stats::count( heap->_counters, kind );
+      }
+    }
+  }
+
+  static ObjectFooter * footer( ObjectHeader * o ) {
+    return (ObjectFooter *) ( (char *) o + o->_objectSize ) - 1;
+  }
+
+  static void setObject( ObjectHeader * o, size_t size, int flags ) {
+    o->_flags = flags;
+    o->_objectSize = size;
+    if ( Checking::Magic ) {
+      o->_magic = flags == ObjAllocated ? AllocatedMagic : FreeMagic;
+    }
+    ObjectFooter * f = footer( o );
+    f->_flags = flags;
+    f->_objectSize = size;
+  }
+
+public:
+  // This is the only instance of the allocator.
+  static AllocatorT TheAllocator;
+
+  // Reads the configuration and registers the exit and fork handlers.
+  // Runs from a constructor before any other; allocation does not
+  // depend on it
+  void initialize();
+
+  // Allocates an object
+  void * allocateObject( size_t size );
+
+  // Allocates an object aligned to alignment, a power of two
+  void * allocateAligned( size_t alignment, size_t size );
+
+  // Frees an object
+  void freeObject( void * ptr );
+
+  // Returns the size of an object
+  size_t objectSize( void * ptr );
+
+  // Coalesces the fast bins, gives the free top of the heap back to the
+  // OS leaving pad bytes, drops the pages inside free objects and
+  // unmaps the extent cache. Returns the number of bytes released
+  size_t trim( size_t pad );
+
+  // At exit handler
+  void atExitHandler();
+
+  // Thread exit handler. Leaves the heap to the next new thread
+  void threadExitHandler( ThreadHeap * heap );
+
+  // pthread_atfork handlers. prepareFork takes every lock so that no
+  // other thread is inside the allocator when fork copies the process
+  void prepareFork();
+  void parentAfterFork();
+  void childAfterFork();
+
+  // Verifies every segment, the free list and every slab. Slab free
+  // lists are walked only for slabs of the calling thread or of exited
+  // threads. Returns the number of errors.
+  size_t checkHeap();
+
+  // Verifies at most maxObjects objects or slabs, resuming where the
+  // previous call stopped. Returns the number of errors.
+  size_t checkHeapIncremental( size_t maxObjects );
+
+  // Copies the free list and the slab descriptors while holding the lock
+  // and verifies the copy after releasing it. Returns the number of errors.
+  size_t checkHeapConcurrent();
+
+  void setCheckCallback( HeapCheckCallback callback, void * arg ) {
+    _checkCallback = callback;
+    _checkCallbackArg = arg;
+  }
+
+  // Fills in info for mallinfo2 and malloc_info. Holds the lock only
+  // to copy counters; the slabs are walked after releasing it
+  void getInfo( HeapInfo & info );
+
+  //Prints the heap size and other information about the allocator
+  void print();
+
+  // Gets memory from the OS
+  void * getMemoryFromOS( size_t size );
+
+  // Returns the size class of a small object
+  static int sizeClass( size_t size ) {
+    return sizeToClass( size );
+  }
+
+  // Returns the object size of a size class
+  static size_t classSize( int sizeClass ) {
+    return TheSizeClasses._info[ sizeClass ]._size;
+  }
+
+  void increaseMallocCalls() { countCall( MallocCall ); }
+
+  void increaseReallocCalls() { countCall( ReallocCall ); }
+
+  void increaseCallocCalls() { countCall( CallocCall ); }
+
+  void increaseFreeCalls() { countCall( FreeCall ); }
+
+};
+
+typedef AllocatorT< Policies< MYMALLOC_LOCKING, MYMALLOC_STATS,
+                              MYMALLOC_CHECKING, MYMALLOC_PLACEMENT,
+                              MYMALLOC_PAGE_SOURCE > > Allocator;
+
+template <class P>
+AllocatorT<P> AllocatorT<P>::TheAllocator;
+
+template <class P>
+__thread ThreadHeap * AllocatorT<P>::_threadHeap;
+
+template <class P>
+Options AllocatorT<P>::_options;
+
+// Writes a complaint about the configuration string to stderr
+static void
+optionWarning( const char * message, const char * text, size_t length,
+               const char * source )
+{
+  const char * parts[] = { "MyMalloc: ", message, " '", NULL, "' in ", source,
+                           "\n" };
+  for ( size_t i = 0; i < sizeof(parts) / sizeof(parts[ 0 ]); i++ ) {
+    const char * part = parts[ i ] ? parts[ i ] : text;
+    size_t n = parts[ i ] ? strlen( part ) : length;
+    if ( write( 2, part, n ) < 0 ) {
+      return;
+    }
+  }
+}
+
+// Parses a decimal number with an optional k, m or g suffix
+static bool
+parseSize( const char * value, size_t length, size_t & result )
+{
+  size_t n = 0;
+  size_t i = 0;
+  for ( ; i < length && value[ i ] >= '0' && value[ i ] <= '9'; i++ ) {
+    if ( n > ( (size_t) -1 - 9 ) / 10 ) {
+      return false;
+    }
+    n = n * 10 + ( value[ i ] - '0' );
+  }
+  if ( i == 0 ) {
+    return false;
+  }
+
+  int shift = 0;
+  if ( i < length ) {
+    switch ( value[ i++ ] ) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    default: return false;
+    }
+  }
+  if ( i != length || n > ( (size_t) -1 >> shift ) ) {
+    return false;
+  }
+  result = n << shift;
+  return true;
+}
+
+static bool
+matches( const char * text, size_t length, const char * word )
+{
+  return strlen( word ) == length && strncmp( text, word, length ) == 0;
+}
+
+// Parses a configuration of the form "key:value,key:value" into options.
+// Unknown keys and bad values are reported and skipped. Runs before the
+// program's constructors, so it only reads the string and writes to
+// stderr; nothing here allocates.
+static void
+parseOptions( const char * conf, const char * source, Options & options )
+{
+  static const struct {
+    const char * _name;
+    size_t Options::* _field;
+  } sizeOptions[] = {
+    { "mmap_threshold", &Options::_mmapThreshold },
+    { "extent_cache", &Options::_extentCacheBytes },
+    { "extent_purge_ms", &Options::_extentPurgeMs },
+    { "extent_unmap_ms", &Options::_extentMaxAgeMs },
+    { "trim_threshold", &Options::_trimThreshold },
+    { "trim_pad", &Options::_trimPad },
+    { "thread_cache", &Options::_threadCacheBytes },
+    { "thread_idle_ms", &Options::_threadIdleMs },
+    { "check", &Options::_checkBudget },
+    { "buddy", &Options::_buddyReserve },
+    { "pool", &Options::_poolBytes }
+  };
+
+  if ( conf == NULL ) {
+    return;
+  }
+
+  while ( *conf ) {
+    const char * key = conf;
+    while ( *conf && *conf != ':' && *conf != ',' ) {
+      conf++;
+    }
+    size_t keyLength = conf - key;
+    if ( *conf != ':' ) {
+      optionWarning( "option without a value", key, keyLength, source );
+      if ( *conf ) {
+        conf++;
+      }
+      continue;
+    }
+    const char * value = ++conf;
+    while ( *conf && *conf != ',' ) {
+      conf++;
+    }
+    size_t valueLength = conf - value;
+    if ( *conf ) {
+      conf++;
+    }
+
+    bool known = false;
+    bool valid = false;
+    for ( size_t i = 0; i < sizeof(sizeOptions) / sizeof(sizeOptions[ 0 ]); i++ ) {
+      if ( matches( key, keyLength, sizeOptions[ i ]._name ) ) {
+        known = true;
+        valid = parseSize( value, valueLength,
+                           options.*( sizeOptions[ i ]._field ) );
+      }
+    }
+    if ( matches( key, keyLength, "thp" ) ) {
+      known = true;
+      valid = true;
+      if ( matches( value, valueLength, "default" ) ) {
+        options._thp = ThpDefault;
+      }
+      else if ( matches( value, valueLength, "always" ) ) {
+        options._thp = ThpAlways;
+      }
+      else if ( matches( value, valueLength, "never" ) ) {
+        options._thp = ThpNever;
+      }
+      else {
+        valid = false;
+      }
+    }
+    if ( matches( key, keyLength, "placement" ) ) {
+      known = true;
+      for ( int i = 0; i < NumPlacements; i++ ) {
+        if ( matches( value, valueLength, placementNames[ i ] ) ) {
+          options._placement = i;
+          valid = true;
+        }
+      }
+    }
+    if ( matches( key, keyLength, "stats_print" ) ) {
+      known = true;
+      valid = true;
+      if ( matches( value, valueLength, "true" ) ) {
+        options._statsPrint = 1;
+      }
+      else if ( matches( value, valueLength, "false" ) ) {
+        options._statsPrint = 0;
+      }
+      else {
+        valid = false;
+      }
+    }
+
+    if ( !known ) {
+      optionWarning( "unknown option", key, keyLength, source );
+    }
+    else if ( !valid ) {
+      optionWarning( "bad value", value, valueLength, source );
+    }
+  }
+}
+
+bool
+PageMap::set( const void * start, size_t size, Slab * slab )
+{
+  uintptr_t first = (uintptr_t) start >> PageShift;
+  uintptr_t last = ( (uintptr_t) start + size - 1 ) >> PageShift;
+
+  for ( uintptr_t page = first; page <= last; page++ ) {
+    std::atomic<Slab **> & root = _root[ page >> LeafBits ];
+    Slab ** leaf = root.load( std::memory_order_relaxed );
+    if ( leaf == NULL ) {
+      void * mem = mmap( NULL, sizeof(Slab *) << LeafBits,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+      if ( mem == MAP_FAILED ) {
+        return false;
+      }
+      leaf = (Slab **) mem;
+      root.store( leaf, std::memory_order_release );
+    }
+    leaf[ page & ( ( 1 << LeafBits ) - 1 ) ] = slab;
+  }
+  return true;
+}
+
+extern "C" void
+atExitHandlerInC()
+{
+  Allocator::TheAllocator.atExitHandler();
+}
+
+extern "C" void
+threadExitHandlerInC( void * heap )
+{
+  Allocator::TheAllocator.threadExitHandler( (ThreadHeap *) heap );
+}
+
+// Priority 101 runs before the constructors of other libraries and of
+// the program, which therefore see MALLOCVERBOSE and MALLOCCHECK applied.
+// Calls that come earlier, from the dynamic loader or from dlsym, are
+// served from the zero-filled static state, so no call ever has to check
+// for initialisation and initialize never re-enters malloc through it.
+__attribute__((constructor(101))) static void
+initializeInC()
+{
+  Allocator::TheAllocator.initialize();
+}
+
+extern "C" void
+prepareForkInC()
+{
+  Allocator::TheAllocator.prepareFork();
+}
+
+extern "C" void
+parentAfterForkInC()
+{
+  Allocator::TheAllocator.parentAfterFork();
+}
+
+extern "C" void
+childAfterForkInC()
+{
+  Allocator::TheAllocator.childAfterFork();
+}
+
+template <class P>
+void
+AllocatorT<P>::initialize()
+{
+  // The configuration compiled into the program comes first, then the
+  // environment; later settings win.
+  int placement = _options._placement;
+  parseOptions( mymalloc_conf, "mymalloc_conf", _options );
+
+  // Environment var VERBOSE prints stats at end and turns on debugging
+  // Default is on
+  const char * envverbose = getenv( "MALLOCVERBOSE" );
+  if ( envverbose && !strcmp( envverbose, "NO") ) {
+    _options._statsPrint = 0;
+  }
+
+  // MALLOCCHECK=n checks n heap objects on every large allocation
+  const char * envcheck = getenv( "MALLOCCHECK" );
+  if ( envcheck ) {
+    _options._checkBudget = strtoul( envcheck, NULL, 10 );
+  }
+
+  parseOptions( getenv( "MYMALLOC_CONF" ), "MYMALLOC_CONF", _options );
+
+  // Objects freed before now are indexed for the default placement
+  if ( _options._placement != placement ) {
+    _lock.lock();
+    reindexFree( placement );
+    _lock.unlock();
+  }
+
+  if ( _options._poolBytes ) {
+    setUpPool();
+  }
+
+  // The lock is not initialised here: a zero-filled lock is unlocked,
+  // and calls that arrived before the constructor may already use it.
+  if ( Locking::ThreadSafe ) {
+    pthread_key_create( &_heapKey, threadExitHandlerInC );
+    pthread_atfork( prepareForkInC, parentAfterForkInC, childAfterForkInC );
+    if ( _threadHeap ) {
+      pthread_setspecific( _heapKey, _threadHeap );
+    }
+  }
+
+  // In verbose mode register also printing statistics at exit
+  atexit( atExitHandlerInC );
+
+  _initialized = 1;
+}
+
+template <class P>
+ThreadHeap *
+AllocatorT<P>::threadHeap()
+{
+  ThreadHeap * heap = _threadHeap;
+  if ( heap ) {
+    return heap;
+  }
+
+  // Adopt the heap of a thread that exited, with all its slabs, before
+  // creating a new one.
+  _lock.lock();
+  heap = _abandonedHeaps;
+  if ( heap ) {
+    _abandonedHeaps = heap->_nextAbandoned;
+    heap->_nextAbandoned = NULL;
+    heap->_abandoned = 0;
+  }
+  else {
+    heap = _heapPool.get();
+    if ( heap ) {
+      heap->_nextHeap = _allHeaps;
+      _allHeaps = heap;
+    }
+  }
+  _lock.unlock();
+
+  // Before initialize there is no key yet; initialize registers the
+  // heap of the thread it runs on
+  if ( heap ) {
+    _threadHeap = heap;
+    if ( Locking::ThreadSafe && _initialized ) {
+      pthread_setspecific( _heapKey, heap );
+    }
+  }
+  return heap;
+}
+
+template <class P>
+void
+AllocatorT<P>::threadExitHandler( ThreadHeap * heap )
+{
+  // Frees done after this point by other destructors of the thread take
+  // the remote path and are picked up by whoever adopts the heap. The
+  // empty slabs, the cache budget and the remote batches go back now;
+  // the slabs in use and the borrowed objects, which live in them, stay
+  // with the heap for the next thread.
+  _threadHeap = NULL;
+
+  lockHeap( heap );
+  releaseCache( heap, true );
+  unlockHeap( heap );
+
+  _lock.lock();
+  heap->_nextAbandoned = _abandonedHeaps;
+  heap->_abandoned = 1;
+  _abandonedHeaps = heap;
+  _lock.unlock();
+}
+
+template <class P>
+void
+AllocatorT<P>::prepareFork()
+{
+  // Always the central lists in class order, then the transfer caches,
+  // then the page heap
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    _central[ c ]._slabs.prepareFork();
+  }
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    _transfer[ c ]._lock.lock();
+  }
+  _lock.lock();
+}
+
+template <class P>
+void
+AllocatorT<P>::parentAfterFork()
+{
+  _lock.unlock();
+  for ( int c = NumSizeClasses - 1; c >= 0; c-- ) {
+    _transfer[ c ]._lock.unlock();
+  }
+  for ( int c = NumSizeClasses - 1; c >= 0; c-- ) {
+    _central[ c ]._slabs.parentAfterFork();
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::childAfterFork()
+{
+  // Only the thread that called fork exists in the child. The heaps of
+  // the others are abandoned like those of exited threads, and give
+  // back their caches as those do on exit, so that the child does not
+  // start with every thread cache of the parent out of reach. Their
+  // slabs in use are handed to the next threads the child creates.
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    _central[ c ]._slabs.childAfterFork();
+    _transfer[ c ]._lock.init();
+  }
+  _lock.init();
+
+  // A thread that was on a fast path during fork may have updated a
+  // slab's free list but not yet its count, or carved objects it had
+  // not yet linked. Counting from the free list makes such an object
+  // unreachable but never hands it out twice; see carve.
+  for ( Slab * slab = _allSlabs; slab; slab = slab->_nextAll ) {
+    if ( slab->_owner == NULL || slab->_owner == _threadHeap ) {
+      continue;
+    }
+    int free = 0;
+    for ( FreeObject * o = slab->_freeList; o && free < slab->_carved;
+          o = o->_next ) {
+      free++;
+    }
+    slab->_used = slab->_carved - free;
+  }
+
+  for ( ThreadHeap * heap = _allHeaps; heap; heap = heap->_nextHeap ) {
+    heap->_busy.store( 0, std::memory_order_relaxed );
+    if ( heap == _threadHeap ) {
+      continue;
+    }
+    lockHeap( heap );
+    releaseCache( heap, true );
+    unlockHeap( heap );
+    if ( !heap->_abandoned ) {
+      heap->_abandoned = 1;
+      heap->_nextAbandoned = _abandonedHeaps;
+      _abandonedHeaps = heap;
+    }
+  }
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateObject( size_t size )
+{
+  if ( size <= MaxSmallSize ) {
+    ThreadHeap * heap = threadHeap();
+    if ( heap == NULL ) {
+      return NULL;
+    }
+
+    // Fast path: pop from the first slab of the class
+    int c = sizeClass( size );
+    Slab * slab = heap->_slabs[ c ];
+    if ( slab && slab->_freeList ) {
+      FreeObject * o = slab->_freeList;
+      slab->_freeList = o->_next;
+      slab->_used++;
+      return o;
+    }
+    return allocateSmallSlow( heap, c );
+  }
+
+  if ( size >= _options._mmapThreshold ) {
+    return allocateMapped( size );
+  }
+  if ( _options._buddyReserve ) {
+    void * block = allocateBuddy( size );
+    if ( block ) {
+      return block;
+    }
+  }
+  return allocateLarge( size, SmallGranularity );
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateSmallSlow( ThreadHeap * heap, int sizeClass )
+{
+  // Objects of this heap's slabs that other threads freed come before
+  // the slabs, a whole batch from the transfer cache at a time
+  FreeObject * o = heap->_borrowed[ sizeClass ];
+  if ( Locking::ThreadSafe && o == NULL ) {
+    o = takeBatch( heap, sizeClass );
+  }
+  if ( o ) {
+    heap->_borrowed[ sizeClass ] = o->_next;
+    return o;
+  }
+
+  lockHeap( heap );
+  __atomic_store_n( &heap->_lastActive, nowMs(), __ATOMIC_RELAXED );
+
+  // Slabs that other threads freed into since they were found full
+  Slab * returned =
+    heap->_returned[ sizeClass ].exchange( NULL, std::memory_order_acquire );
+  while ( returned ) {
+    Slab * next = returned->_nextReturned;
+    returned->_next = heap->_slabs[ sizeClass ];
+    heap->_slabs[ sizeClass ] = returned;
+    returned = next;
+  }
+
+  // Look for a slab of the class with free objects. Full slabs are taken
+  // off the list so that no later search walks them again, and empty
+  // slabs past the first one found are given back, except for the
+  // heap's _keep, so one thread cannot hoard them.
+  int keep = __atomic_load_n( &heap->_keep[ sizeClass ], __ATOMIC_RELAXED );
+  int kept = 0;
+  int released = 0;
+  Slab * prev = NULL;
+  Slab * found = NULL;
+  Slab * foundPrev = NULL;
+  Slab * empty = NULL;
+  Slab * slab = heap->_slabs[ sizeClass ];
+  while ( slab ) {
+    Slab * next = slab->_next;
+    if ( slab->_freeList || collectRemoteFrees( slab ) ||
+         slab->_carved < slab->_capacity ) {
+      if ( found && slab->_used == 0 && kept++ >= keep ) {
+        prev->_next = next;
+        slab->_next = empty;
+        empty = slab;
+        released++;
+        slab = next;
+        continue;
+      }
+      if ( !found ) {
+        found = slab;
+        foundPrev = prev;
+      }
+    }
+    else if ( markFull( slab ) ) {
+      if ( prev ) {
+        prev->_next = next;
+      }
+      else {
+        heap->_slabs[ sizeClass ] = next;
+      }
+      slab = next;
+      continue;
+    }
+    prev = slab;
+    slab = next;
+  }
+  if ( empty ) {
+    releaseSlabs( empty );
+    heap->_released[ sizeClass ] += released;
+  }
+
+  if ( found == NULL ) {
+    // A slab given back since the last miss would have saved this one
+    if ( heap->_released[ sizeClass ] ) {
+      growCache( heap, sizeClass );
+    }
+    heap->_released[ sizeClass ] = 0;
+    heap->_walks[ sizeClass ] = 0;
+
+    if ( Locking::ThreadSafe ) {
+      scavenge( heap );
+    }
+    found = getSlab( heap, sizeClass );
+    if ( found == NULL ) {
+      unlockHeap( heap );
+      errno = ENOMEM;
+      return NULL;
+    }
+    found->_next = heap->_slabs[ sizeClass ];
+    heap->_slabs[ sizeClass ] = found;
+  }
+  else if ( foundPrev ) {
+    // Move it to the front so the fast path finds it
+    foundPrev->_next = found->_next;
+    found->_next = heap->_slabs[ sizeClass ];
+    heap->_slabs[ sizeClass ] = found;
+  }
+
+  if ( found->_freeList == NULL ) {
+    carve( found );
+  }
+
+  else if ( ++heap->_walks[ sizeClass ] >= CacheIdleWalks ) {
+    heap->_walks[ sizeClass ] = 0;
+    heap->_released[ sizeClass ] = 0;
+    if ( keep > 0 ) {
+      shrinkCache( heap, sizeClass );
+    }
+  }
+
+  o = found->_freeList;
+  found->_freeList = o->_next;
+  found->_used++;
+  unlockHeap( heap );
+  return o;
+}
+
+template <class P>
+void
+AllocatorT<P>::releaseCache( ThreadHeap * heap, bool all )
+{
+  // The slabs are unlinked and disowned under _lock, so the heap checks,
+  // which hold it, either walk a slab's lists before it goes or see it
+  // without an owner
+  Slab * lists[ NumSizeClasses ];
+  _lock.lock();
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    lists[ c ] = NULL;
+    Slab ** link = &heap->_slabs[ c ];
+    if ( !all ) {
+      // The fast path uses the first slab without the heap lock
+      Slab * first = __atomic_load_n( link, __ATOMIC_ACQUIRE );
+      if ( first == NULL ) {
+        continue;
+      }
+      link = &first->_next;
+    }
+    while ( Slab * slab = *link ) {
+      if ( __atomic_load_n( &slab->_used, __ATOMIC_ACQUIRE ) == 0 ) {
+        *link = slab->_next;
+        slab->_owner = NULL;
+        slab->_next = lists[ c ];
+        lists[ c ] = slab;
+      }
+      else {
+        link = &slab->_next;
+      }
+    }
+    while ( heap->_keep[ c ] > 0 ) {
+      dropKeep( heap, c );
+    }
+  }
+  _lock.unlock();
+
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    if ( lists[ c ] ) {
+      releaseSlabs( lists[ c ] );
+    }
+    if ( all && heap->_remote[ c ] ) {
+      flushRemote( heap, c );
+    }
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::scavenge( ThreadHeap * self )
+{
+  uint64_t idle = _options._threadIdleMs;
+  uint64_t now = nowMs();
+  uint64_t last = _lastScavenge.load( std::memory_order_relaxed );
+  if ( idle == 0 || now < last + idle ||
+       !_lastScavenge.compare_exchange_strong( last, now,
+                                               std::memory_order_relaxed ) ) {
+    return;
+  }
+
+  // Heaps are never freed and new ones go in front, so once the head is
+  // read the list can be walked without the lock. A heap whose owner is
+  // in its slow path is busy, not idle, and is skipped; one whose owner
+  // wakes up meanwhile waits only for this heap's turn.
+  _lock.lock();
+  ThreadHeap * heap = _allHeaps;
+  _lock.unlock();
+  for ( ; heap; heap = heap->_nextHeap ) {
+    if ( heap == self ||
+         __atomic_load_n( &heap->_lastActive, __ATOMIC_RELAXED ) + idle > now ) {
+      continue;
+    }
+    if ( tryLockHeap( heap ) ) {
+      releaseCache( heap, false );
+      unlockHeap( heap );
+    }
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::growCache( ThreadHeap * heap, int sizeClass )
+{
+  size_t bytes = TheSizeClasses._info[ sizeClass ]._slabSize;
+  _lock.lock();
+  if ( _threadCacheBytes + bytes > _options._threadCacheBytes ) {
+    stealCache( heap, bytes );
+  }
+  if ( _threadCacheBytes + bytes <= _options._threadCacheBytes ) {
+    __atomic_store_n( &heap->_keep[ sizeClass ], heap->_keep[ sizeClass ] + 1,
+                      __ATOMIC_RELAXED );
+    heap->_cacheBytes += bytes;
+    _threadCacheBytes += bytes;
+  }
+  _lock.unlock();
+}
+
+template <class P>
+void
+AllocatorT<P>::shrinkCache( ThreadHeap * heap, int sizeClass )
+{
+  _lock.lock();
+  if ( heap->_keep[ sizeClass ] > 0 ) {
+    dropKeep( heap, sizeClass );
+  }
+  _lock.unlock();
+}
+
+template <class P>
+void
+AllocatorT<P>::stealCache( ThreadHeap * thief, size_t bytes )
+{
+  // Heaps of exited threads are idle since their thread's last slow
+  // path, so they are the first victims. A victim gives back the slabs
+  // above its new _keep the next time it walks the class.
+  while ( _threadCacheBytes + bytes > _options._threadCacheBytes ) {
+    ThreadHeap * victim = NULL;
+    for ( ThreadHeap * heap = _allHeaps; heap; heap = heap->_nextHeap ) {
+      if ( heap != thief && heap->_cacheBytes > 0 &&
+           ( victim == NULL ||
+             __atomic_load_n( &heap->_lastActive, __ATOMIC_RELAXED ) <
+             __atomic_load_n( &victim->_lastActive, __ATOMIC_RELAXED ) ) ) {
+        victim = heap;
+      }
+    }
+    if ( victim == NULL ) {
+      return;
+    }
+
+    // Its class with the most bytes kept
+    int largest = 0;
+    size_t largestBytes = 0;
+    for ( int c = 0; c < NumSizeClasses; c++ ) {
+      size_t keptBytes = victim->_keep[ c ] * TheSizeClasses._info[ c ]._slabSize;
+      if ( keptBytes > largestBytes ) {
+        largest = c;
+        largestBytes = keptBytes;
+      }
+    }
+    dropKeep( victim, largest );
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::dropKeep( ThreadHeap * heap, int sizeClass )
+{
+  size_t bytes = TheSizeClasses._info[ sizeClass ]._slabSize;
+  __atomic_store_n( &heap->_keep[ sizeClass ], heap->_keep[ sizeClass ] - 1,
+                    __ATOMIC_RELAXED );
+  heap->_cacheBytes -= bytes;
+  _threadCacheBytes -= bytes;
+}
+
+template <class P>
+void
+AllocatorT<P>::freeRemoteList( FreeObject * list )
+{
+  while ( list ) {
+    FreeObject * next = list->_next;
+    freeRemote( _pageMap.lookup( list ), list );
+    list = next;
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::flushRemote( ThreadHeap * heap, int sizeClass )
+{
+  FreeObject * batch = heap->_remote[ sizeClass ];
+  ThreadHeap * owner = heap->_remoteOwner[ sizeClass ];
+  heap->_remote[ sizeClass ] = NULL;
+  heap->_remoteCount[ sizeClass ] = 0;
+
+  // The oldest batch is the likeliest to belong to a heap that is not
+  // allocating, since owners take theirs back when they run out
+  TransferCache & transfer = _transfer[ sizeClass ];
+  FreeObject * evicted = NULL;
+  transfer._lock.lock();
+  int count = transfer._count;
+  if ( count == TransferBatches ) {
+    evicted = transfer._batches[ 0 ];
+    count--;
+    memmove( transfer._batches, transfer._batches + 1,
+             count * sizeof(FreeObject *) );
+    memmove( transfer._owners, transfer._owners + 1,
+             count * sizeof(ThreadHeap *) );
+  }
+  transfer._batches[ count ] = batch;
+  transfer._owners[ count ] = owner;
+  __atomic_store_n( &transfer._count, count + 1, __ATOMIC_RELAXED );
+  transfer._lock.unlock();
+
+  freeRemoteList( evicted );
+}
+
+template <class P>
+FreeObject *
+AllocatorT<P>::takeBatch( ThreadHeap * heap, int sizeClass )
+{
+  // The count is read without the lock, so an empty cache costs no lock
+  TransferCache & transfer = _transfer[ sizeClass ];
+  if ( __atomic_load_n( &transfer._count, __ATOMIC_RELAXED ) == 0 ) {
+    return NULL;
+  }
+
+  // The newest batch of this heap, keeping the others in order
+  FreeObject * batch = NULL;
+  transfer._lock.lock();
+  for ( int i = transfer._count - 1; i >= 0; i-- ) {
+    if ( transfer._owners[ i ] == heap ) {
+      int count = transfer._count - 1;
+      batch = transfer._batches[ i ];
+      memmove( transfer._batches + i, transfer._batches + i + 1,
+               ( count - i ) * sizeof(FreeObject *) );
+      memmove( transfer._owners + i, transfer._owners + i + 1,
+               ( count - i ) * sizeof(ThreadHeap *) );
+      __atomic_store_n( &transfer._count, count, __ATOMIC_RELAXED );
+      break;
+    }
+  }
+  transfer._lock.unlock();
+  return batch;
+}
+
+template <class P>
+bool
+AllocatorT<P>::collectRemoteFrees( Slab * slab )
+{
+  FreeObject * list =
+    slab->_remoteFree.exchange( NULL, std::memory_order_acquire );
+  if ( list == NULL ) {
+    return false;
+  }
+
+  FreeObject * tail = list;
+  int count = 1;
+  while ( tail->_next ) {
+    tail = tail->_next;
+    count++;
+  }
+  tail->_next = slab->_freeList;
+  slab->_freeList = list;
+  slab->_used -= count;
+  return true;
+}
+
+template <class P>
+void
+AllocatorT<P>::carve( Slab * slab )
+{
+  int n = slab->_capacity - slab->_carved;
+  int batch = TheSizeClasses._info[ slab->_sizeClass ]._batchSize;
+  if ( n > batch ) {
+    n = batch;
+  }
+
+  char * first = slab->_start + slab->_carved * slab->_objectSize;
+  slab->_carved += n;
+
+  // fork may copy the heap of a thread that is in the middle of carving.
+  // Counting the objects as carved before linking them means the child
+  // can lose a few objects but never carves the same ones twice.
+  std::atomic_signal_fence( std::memory_order_seq_cst );
+
+  // Link them in address order so consecutive mallocs walk forward
+  FreeObject * list = slab->_freeList;
+  for ( int i = n - 1; i >= 0; i-- ) {
+    FreeObject * o = (FreeObject *) ( first + i * slab->_objectSize );
+    o->_next = list;
+    list = o;
+  }
+  slab->_freeList = list;
+}
+
+template <class P>
+Slab *
+AllocatorT<P>::getSlab( ThreadHeap * owner, int sizeClass )
+{
+  const SizeClassInfo & info = TheSizeClasses._info[ sizeClass ];
+  CentralList & central = _central[ sizeClass ];
+  Slab * slab = central._slabs.pop();
+  if ( slab ) {
+    central._bytes.fetch_sub( info._slabSize, std::memory_order_relaxed );
+    slab->_owner = owner;
+    slab->_next = NULL;
+    return slab;
+  }
+
+  // Slabs start on a page so that no page holds two slabs or a slab
+  // and a large object; that keeps the page map exact and the slab
+  // boundaries cache-line aligned.
+  char * start = (char *) allocateLarge( info._slabSize, PageSize );
+  if ( start == NULL ) {
+    return NULL;
+  }
+
+  _lock.lock();
+  slab = _slabPool.get();
+  if ( slab && !_pageMap.set( start, info._slabSize, slab ) ) {
+    _slabPool.put( slab );
+    slab = NULL;
+  }
+  if ( slab == NULL ) {
+    freeLarge( (ObjectHeader *) start - 1 );
+    _lock.unlock();
+    return NULL;
+  }
+
+  slab->_owner = owner;
+  slab->_start = start;
+  slab->_next = NULL;
+  slab->_freeList = NULL;
+  slab->_remoteFree.store( NULL, std::memory_order_relaxed );
+  slab->_sizeClass = sizeClass;
+  slab->_objectSize = info._size;
+  slab->_capacity = info._objectsPerSlab;
+  slab->_carved = 0;
+  slab->_used = 0;
+
+  slab->_prevAll = NULL;
+  slab->_nextAll = _allSlabs;
+  if ( _allSlabs ) {
+    _allSlabs->_prevAll = slab;
+  }
+  _allSlabs = slab;
+  _slabCount++;
+  _slabBytes += info._slabSize;
+  _lock.unlock();
+
+  return slab;
+}
+
+template <class P>
+void
+AllocatorT<P>::releaseSlabs( Slab * list )
+{
+  // The slabs keep their carved objects, so the next owner starts with
+  // a full free list
+  size_t slabSize = TheSizeClasses._info[ list->_sizeClass ]._slabSize;
+  CentralList & central = _central[ list->_sizeClass ];
+  size_t room = central._bytes.load( std::memory_order_relaxed );
+  room = room < CentralListBytes ? CentralListBytes - room : 0;
+
+  Slab * first = NULL;
+  Slab * last = NULL;
+  size_t kept = 0;
+  while ( list ) {
+    Slab * next = list->_next;
+    if ( kept + slabSize <= room ) {
+      list->_owner = NULL;
+      list->_next = first;
+      if ( first == NULL ) {
+        last = list;
+      }
+      first = list;
+      kept += slabSize;
+    }
+    else {
+      destroySlab( list );
+    }
+    list = next;
+  }
+
+  if ( first ) {
+    central._bytes.fetch_add( kept, std::memory_order_relaxed );
+    central._slabs.pushList( first, last );
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::destroySlab( Slab * slab )
+{
+  _lock.lock();
+  if ( _checkSlab == slab ) {
+    _checkSlab = slab->_nextAll;
+  }
+  if ( slab->_prevAll ) {
+    slab->_prevAll->_nextAll = slab->_nextAll;
+  }
+  else {
+    _allSlabs = slab->_nextAll;
+  }
+  if ( slab->_nextAll ) {
+    slab->_nextAll->_prevAll = slab->_prevAll;
+  }
+  _slabCount--;
+  _slabBytes -= TheSizeClasses._info[ slab->_sizeClass ]._slabSize;
+
+  _pageMap.set( slab->_start,
+                TheSizeClasses._info[ slab->_sizeClass ]._slabSize, NULL );
+  freeLarge( (ObjectHeader *) slab->_start - 1 );
+  _slabPool.put( slab );
+  _lock.unlock();
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateLarge( size_t size, size_t alignment )
+{
+  // Add the header and footer to the size and round the total size up
+  // to a multiple of SmallGranularity for alignment.
+  size_t totalSize = ( size + ObjectOverhead + SmallGranularity - 1 ) &
+                     ~(size_t) ( SmallGranularity - 1 );
+  if ( totalSize < size ) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ( totalSize < MinObjectSize ) {
+    totalSize = MinObjectSize;
+  }
+
+  if ( _options._checkBudget ) {
+    checkHeapIncremental( _options._checkBudget );
+  }
+
+  // Aligned objects may need to split a free object off the front
+  size_t searchSize = totalSize;
+  if ( alignment > SmallGranularity ) {
+    searchSize += alignment + MinObjectSize;
+  }
+
+  _lock.lock();
+
+  if ( alignment <= SmallGranularity && totalSize < FastBinMaxSize &&
+       _options._placement != PlaceTlsf ) {
+    // The bin of totalSize holds sizes within FastBinStep of it, the
+    // next bin only larger ones. The object is reused whole: most are
+    // freed and allocated again at the same size.
+    int bin = totalSize / FastBinStep;
+    FreeObjectHeader * f = _fastBins[ bin ];
+    if ( f == NULL || f->_objectSize < totalSize ) {
+      bin++;
+      f = bin < NumFastBins ? _fastBins[ bin ] : NULL;
+    }
+    if ( f ) {
+      _fastBins[ bin ] = f->_next;
+      _fastBytes -= f->_objectSize;
+      _fastCount--;
+      setObject( f, f->_objectSize, ObjAllocated );
+      _lock.unlock();
+      return (void *) ( (ObjectHeader *) f + 1 );
+    }
+  }
+
+  // You should get memory from the OS only if the memory in the free list could not
+  // satisfy the request.
+  FreeChunk * chunk = findFree( searchSize );
+  if ( chunk == NULL && _fastBytes ) {
+    consolidateFastBins();
+    chunk = findFree( searchSize );
+  }
+  if ( chunk == NULL ) {
+    if ( !growHeap( searchSize ) ) {
+      _lock.unlock();
+      errno = ENOMEM;
+      return NULL;
+    }
+    chunk = findFree( searchSize );
+  }
+  ObjectHeader * o = chunk->_object;
+  size_t available = chunk->_objectSize;
+
+  // Next fit and address order keep the rest of the chunk where the
+  // chunk was: the rover stays on it, and the order needs no new search
+  int placement = _options._placement;
+  if ( ( placement == PlaceNext || placement == PlaceAddress ) &&
+       alignment <= SmallGranularity &&
+       available - totalSize >= MinObjectSize ) {
+    ObjectHeader * rest = (ObjectHeader *) ( (char *) o + totalSize );
+    setObject( rest, available - totalSize, ObjFree );
+    ( (FreeObjectHeader *) rest )->_chunk = chunk;
+    unindexChunk( chunk );
+    chunk->_object = rest;
+    chunk->_objectSize = available - totalSize;
+    indexChunk( chunk );
+    _freeBytes -= totalSize;
+    setObject( o, totalSize, ObjAllocated );
+    _lock.unlock();
+    return (void *) ( o + 1 );
+  }
+  removeFree( chunk );
+
+  ObjectHeader * result = o;
+
+  if ( alignment > SmallGranularity ) {
+    char * user = (char *) o + sizeof(ObjectHeader);
+    char * aligned = (char *) ( ( (uintptr_t) user + alignment - 1 ) &
+                                ~(uintptr_t) ( alignment - 1 ) );
+    if ( aligned != user && (size_t) ( aligned - user ) < MinObjectSize ) {
+      aligned = (char *) ( ( (uintptr_t) user + MinObjectSize + alignment - 1 ) &
+                           ~(uintptr_t) ( alignment - 1 ) );
+    }
+    size_t front = aligned - user;
+    if ( front ) {
+      insertFree( o, front );
+      result = (ObjectHeader *) ( (char *) o + front );
+      available -= front;
+    }
+  }
+
+  // Split off the tail if what is left can hold an object. The original
+  // object had no free neighbours, so neither do the fragments.
+  if ( available - totalSize >= MinObjectSize ) {
+    insertFree( (ObjectHeader *) ( (char *) result + totalSize ),
+                available - totalSize );
+    available = totalSize;
+  }
+  setObject( result, available, ObjAllocated );
+
+  _lock.unlock();
+
+  // Return the pointer after the object header.
+  return (void *) ( result + 1 );
+}
+
+template <class P>
+bool
+AllocatorT<P>::growHeap( size_t size )
+{
+  // Room for the fence posts, in whole pages
+  size_t request = size + sizeof(ObjectHeader) + sizeof(ObjectFooter);
+  if ( request < ArenaGrowth ) {
+    request = ArenaGrowth;
+  }
+  request = ( request + PageSize - 1 ) & ~(size_t) ( PageSize - 1 );
+  if ( request < size ) {
+    return false;
+  }
+
+  Segment * segment = _segmentPool.get();
+  if ( segment == NULL ) {
+    return false;
+  }
+
+  char * mem = (char *) getMemoryFromOS( request );
+  if ( mem == NULL ) {
+    _segmentPool.put( segment );
+    return false;
+  }
+  adviseHugePages( mem, request );
+  char * end = mem + request;
+
+  ObjectHeader * o;
+  if ( PageSource::Contiguous && _lastSegment && mem == _lastSegment->_end ) {
+    // Reuse the fence post at the end of the previous segment
+    o = (ObjectHeader *) ( mem - sizeof(ObjectHeader) );
+    _segmentPool.put( segment );
+    _lastSegment->_end = end;
+  }
+  else {
+    ObjectFooter * fence = (ObjectFooter *) mem;
+    fence->_flags = ObjAllocated;
+    fence->_objectSize = sizeof(ObjectFooter);
+    o = (ObjectHeader *) ( fence + 1 );
+
+    segment->_start = mem;
+    segment->_end = end;
+    if ( _lastSegment ) {
+      _lastSegment->_next = segment;
+    }
+    else {
+      _segments = segment;
+    }
+    _lastSegment = segment;
+  }
+
+  ObjectHeader * fence = (ObjectHeader *) end - 1;
+  fence->_flags = ObjAllocated;
+  fence->_magic = AllocatedMagic;
+  fence->_objectSize = sizeof(ObjectHeader);
+
+  setObject( o, (char *) fence - (char *) o, ObjAllocated );
+  freeLarge( o );
+  return true;
+}
+
+template <class P>
+bool
+AllocatorT<P>::growBuddy()
+{
+  size_t rootSize = (size_t) 1 << BuddyMaxOrder;
+
+  if ( _buddyStart == NULL ) {
+    // Reserve the space aligned to a root, so that offsets and addresses
+    // have the same low bits
+    size_t reserve = _options._buddyReserve & ~( rootSize - 1 );
+    char * mem = reserve == 0 ? (char *) MAP_FAILED :
+      (char *) mmap( NULL, reserve + rootSize, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if ( mem == MAP_FAILED ) {
+      // Leave the heap off rather than try again on every allocation
+      _options._buddyReserve = 0;
+      return false;
+    }
+    char * start = (char *) ( ( (uintptr_t) mem + rootSize - 1 ) &
+                              ~(uintptr_t) ( rootSize - 1 ) );
+    if ( start != mem ) {
+      munmap( mem, start - mem );
+    }
+    munmap( start + reserve, mem + rootSize - start );
+
+    // An order per smallest block, then the bitmaps
+    size_t metaSize = reserve >> BuddyMinOrder;
+    for ( int k = 0; k < NumBuddyOrders; k++ ) {
+      metaSize += ( ( reserve >> ( BuddyMinOrder + k ) ) + 63 ) / 64 *
+                  sizeof(uint64_t);
+    }
+    char * meta = (char *) mmap( NULL, metaSize, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( meta == MAP_FAILED ) {
+      munmap( start, reserve );
+      _options._buddyReserve = 0;
+      return false;
+    }
+    _buddyOrders = (uint8_t *) meta;
+    meta += reserve >> BuddyMinOrder;
+    meta = (char *) ( ( (uintptr_t) meta + sizeof(uint64_t) - 1 ) &
+                      ~(uintptr_t) ( sizeof(uint64_t) - 1 ) );
+    for ( int k = 0; k < NumBuddyOrders; k++ ) {
+      _buddyBits[ k ] = (uint64_t *) meta;
+      meta += ( ( reserve >> ( BuddyMinOrder + k ) ) + 63 ) / 64 *
+              sizeof(uint64_t);
+    }
+
+    // Published last: inBuddy reads it without the lock
+    _buddyStart = start;
+    __atomic_store_n( &_buddyReserved, reserve, __ATOMIC_RELEASE );
+  }
+
+  if ( _buddySize + rootSize > _buddyReserved ) {
+    return false;
+  }
+  char * root = _buddyStart + _buddySize;
+  if ( mprotect( root, rootSize, PROT_READ | PROT_WRITE ) != 0 ) {
+    return false;
+  }
+  adviseHugePages( root, rootSize );
+  _buddySize += rootSize;
+  pushBuddy( root, NumBuddyOrders - 1 );
+  return true;
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateBuddy( size_t size )
+{
+  int order = size <= (size_t) BuddyMinSize ? (int) BuddyMinOrder :
+              64 - __builtin_clzll( size - 1 );
+  if ( order > BuddyMaxOrder ) {
+    return NULL;
+  }
+  int k = order - BuddyMinOrder;
+
+  _lock.lock();
+
+  // The smallest free block that is large enough, or a new root
+  int j;
+  unsigned larger = _buddyNonEmpty >> k;
+  if ( larger ) {
+    j = k + __builtin_ctz( larger );
+  }
+  else if ( growBuddy() ) {
+    j = NumBuddyOrders - 1;
+  }
+  else {
+    _lock.unlock();
+    return NULL;
+  }
+  BuddyBlock * b = _buddyLists[ j ];
+  unlinkBuddy( b, j );
+
+  // Keep the lower half and free the upper one until the block fits
+  while ( j > k ) {
+    j--;
+    pushBuddy( (char *) b + ( (size_t) BuddyMinSize << j ), j );
+    _buddySplits++;
+  }
+
+  _buddyOrders[ ( (char *) b - _buddyStart ) >> BuddyMinOrder ] = order;
+  _buddyAllocs++;
+  _buddyRequested += size;
+  _buddyGranted += (size_t) 1 << order;
+  _lock.unlock();
+
+  return b;
+}
+
+template <class P>
+void
+AllocatorT<P>::freeBuddy( void * ptr )
+{
+  size_t offset = (char *) ptr - _buddyStart;
+  int order = _buddyOrders[ offset >> BuddyMinOrder ];
+  if ( Checking::Validate &&
+       ( order == 0 || ( offset & ( ( (size_t) 1 << order ) - 1 ) ) ) ) {
+    checkFailed( "free of a pointer that is not an allocated buddy block",
+                 ptr );
+  }
+  if ( Checking::Poison ) {
+    memset( ptr, 0xdf, (size_t) 1 << order );
+  }
+
+  _lock.lock();
+  _buddyOrders[ offset >> BuddyMinOrder ] = 0;
+
+  // Merge while the buddy, the other half of the block one order up,
+  // is free
+  int k = order - BuddyMinOrder;
+  while ( k < NumBuddyOrders - 1 ) {
+    size_t buddy = offset ^ ( (size_t) BuddyMinSize << k );
+    if ( ( buddyWord( k, buddy ) & buddyBit( k, buddy ) ) == 0 ) {
+      break;
+    }
+    unlinkBuddy( (BuddyBlock *) ( _buddyStart + buddy ), k );
+    offset &= ~( (size_t) BuddyMinSize << k );
+    k++;
+    _buddyMerges++;
+  }
+  pushBuddy( _buddyStart + offset, k );
+  _lock.unlock();
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateMapped( size_t size )
+{
+  size_t need = ( size + sizeof(ObjectHeader) + PageSize - 1 ) &
+                ~(size_t) ( PageSize - 1 );
+  if ( need < size ) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // Best fit among the extents that waste little
+  _lock.lock();
+  Extent * best = NULL;
+  for ( Extent * e = _extents; e; e = e->_next ) {
+    if ( e->_size >= need && e->_size - need <= need / ExtentSlackFraction &&
+         ( best == NULL || e->_size < best->_size ) ) {
+      best = e;
+      if ( e->_size == need ) {
+        break;
+      }
+    }
+  }
+
+  char * mem = NULL;
+  size_t mapSize = need;
+  Extent * victims = NULL;
+  if ( best ) {
+    unlinkExtent( best );
+    mem = best->_start;
+    mapSize = best->_size;
+    _cachedBytes -= mapSize;
+    _cachedCount--;
+    _extentPool.put( best );
+    _extentHits++;
+  }
+  else {
+    _extentMisses++;
+    victims = decayExtents();
+  }
+  _lock.unlock();
+  unmapExtents( victims );
+
+  if ( mem == NULL ) {
+    mem = (char *) mmap( NULL, need, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( mem == MAP_FAILED ) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    adviseHugePages( mem, need );
+  }
+
+  ObjectHeader * o = (ObjectHeader *) mem;
+  o->_flags = ObjMapped;
+  if ( Checking::Magic ) {
+    o->_magic = AllocatedMagic;
+  }
+  o->_objectSize = mapSize;
+  _mappedBytes.fetch_add( mapSize, std::memory_order_relaxed );
+  _mappedCount.fetch_add( 1, std::memory_order_relaxed );
+  return (void *) ( o + 1 );
+}
+
+template <class P>
+void
+AllocatorT<P>::freeMapped( ObjectHeader * o )
+{
+  size_t size = o->_objectSize;
+  _mappedBytes.fetch_sub( size, std::memory_order_relaxed );
+  _mappedCount.fetch_sub( 1, std::memory_order_relaxed );
+  if ( size > _options._extentCacheBytes ) {
+    munmap( o, size );
+    return;
+  }
+  if ( Checking::Magic ) {
+    o->_magic = FreeMagic;
+  }
+
+  _lock.lock();
+  Extent * e = _extentPool.get();
+  if ( e == NULL ) {
+    _lock.unlock();
+    munmap( o, size );
+    return;
+  }
+  e->_start = (char *) o;
+  e->_size = size;
+  e->_freedAt = nowMs();
+  e->_purged = 0;
+  e->_prev = NULL;
+  e->_next = _extents;
+  if ( _extents ) {
+    _extents->_prev = e;
+  }
+  else {
+    _oldestExtent = e;
+  }
+  _extents = e;
+  _cachedBytes += size;
+  _cachedCount++;
+
+  Extent * victims = decayExtents();
+  _lock.unlock();
+  unmapExtents( victims );
+}
+
+template <class P>
+Extent *
+AllocatorT<P>::decayExtents()
+{
+  uint64_t now = nowMs();
+
+  Extent * victims = NULL;
+  while ( _oldestExtent &&
+          ( _cachedBytes > _options._extentCacheBytes ||
+            now - _oldestExtent->_freedAt >= _options._extentMaxAgeMs ) ) {
+    Extent * e = _oldestExtent;
+    unlinkExtent( e );
+    _cachedBytes -= e->_size;
+    _cachedCount--;
+    _extentUnmaps++;
+    e->_next = victims;
+    victims = e;
+  }
+
+  // The list is in the order extents were freed, so the ones idle long
+  // enough are at the old end. Purging keeps them mapped: a later reuse
+  // costs page faults but no system call.
+  for ( Extent * e = _oldestExtent;
+        e && now - e->_freedAt >= _options._extentPurgeMs; e = e->_prev ) {
+    if ( !e->_purged ) {
+      madvise( e->_start, e->_size, MYMALLOC_MADV_PURGE );
+      e->_purged = 1;
+      _extentPurges++;
+    }
+  }
+
+  return victims;
+}
+
+template <class P>
+void
+AllocatorT<P>::unmapExtents( Extent * list )
+{
+  if ( list == NULL ) {
+    return;
+  }
+  for ( Extent * e = list; e; e = e->_next ) {
+    munmap( e->_start, e->_size );
+  }
+
+  _lock.lock();
+  while ( list ) {
+    Extent * next = list->_next;
+    _extentPool.put( list );
+    list = next;
+  }
+  _lock.unlock();
+}
+
+template <class P>
+void
+AllocatorT<P>::unlinkExtent( Extent * e )
+{
+  if ( e->_prev ) {
+    e->_prev->_next = e->_next;
+  }
+  else {
+    _extents = e->_next;
+  }
+  if ( e->_next ) {
+    e->_next->_prev = e->_prev;
+  }
+  else {
+    _oldestExtent = e->_prev;
+  }
+}
+
+template <class P>
+size_t
+AllocatorT<P>::trimTop( size_t pad )
+{
+  size_t topSize = topFreeSize();
+  if ( topSize == 0 ) {
+    return 0;
+  }
+  char * end = _lastSegment->_end;
+  char * top = end - sizeof(ObjectHeader) - topSize;
+
+  // Keep a free object of at least MinObjectSize followed by the fence
+  // post, and cut at a page boundary
+  size_t keep = pad < MinObjectSize ? (size_t) MinObjectSize : pad;
+  if ( keep >= topSize ) {
+    return 0;
+  }
+  char * newEnd = (char *) ( ( (uintptr_t) top + keep + sizeof(ObjectHeader) +
+                               PageSize - 1 ) & ~(uintptr_t) ( PageSize - 1 ) );
+  if ( newEnd >= end ) {
+    return 0;
+  }
+  size_t released = end - newEnd;
+  if ( !PageSource::release( newEnd, released ) ) {
+    return 0;
+  }
+
+  removeFree( chunkOf( (ObjectHeader *) top ) );
+  _lastSegment->_end = newEnd;
+  ObjectHeader * fence = (ObjectHeader *) newEnd - 1;
+  fence->_flags = ObjAllocated;
+  fence->_magic = AllocatedMagic;
+  fence->_objectSize = sizeof(ObjectHeader);
+  insertFree( (ObjectHeader *) top, (char *) fence - top );
+
+  // The only object past the top free one is the old fence post, where
+  // checkHeapIncremental may have stopped
+  if ( _checkObject && (char *) _checkObject > top &&
+       _checkSegment == _lastSegment ) {
+    _checkObject = fence;
+  }
+
+  _heapSize -= released;
+  return released;
+}
+
+template <class P>
+size_t
+AllocatorT<P>::purgeFreePages()
+{
+  // The header with the pointer to the entry and the footer stay in
+  // place. Only the entries are read
+  size_t purged = 0;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    char * start = (char *) c->_object;
+    purged += purgePages( start + sizeof(FreeObjectHeader),
+                          start + c->_objectSize - sizeof(ObjectFooter) );
+  }
+
+  // Free buddy blocks keep their links
+  for ( int k = 0; k < NumBuddyOrders; k++ ) {
+    for ( BuddyBlock * b = _buddyLists[ k ]; b; b = b->_next ) {
+      purged += purgePages( (char *) ( b + 1 ),
+                            (char *) b + ( (size_t) BuddyMinSize << k ) );
+    }
+  }
+  return purged;
+}
+
+template <class P>
+size_t
+AllocatorT<P>::trim( size_t pad )
+{
+  // Batches in the transfer caches go back to their slabs, and the
+  // empty slabs of the central lists go back to the heap
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    TransferCache & transfer = _transfer[ c ];
+    transfer._lock.lock();
+    int count = transfer._count;
+    FreeObject * batches[ TransferBatches ];
+    memcpy( batches, transfer._batches, count * sizeof(FreeObject *) );
+    __atomic_store_n( &transfer._count, 0, __ATOMIC_RELAXED );
+    transfer._lock.unlock();
+    for ( int i = 0; i < count; i++ ) {
+      freeRemoteList( batches[ i ] );
+    }
+  }
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    CentralList & central = _central[ c ];
+    Slab * slab = central._slabs.popAll();
+    while ( slab ) {
+      central._bytes.fetch_sub( TheSizeClasses._info[ c ]._slabSize,
+                                std::memory_order_relaxed );
+      Slab * next = slab->_next;
+      destroySlab( slab );
+      slab = next;
+    }
+  }
+
+  _lock.lock();
+  consolidateFastBins();
+  size_t released = trimTop( pad );
+  released += purgeFreePages();
+
+  Extent * victims = _extents;
+  for ( Extent * e = _extents; e; e = e->_next ) {
+    released += e->_size;
+    _extentUnmaps++;
+  }
+  _extents = NULL;
+  _oldestExtent = NULL;
+  _cachedBytes = 0;
+  _cachedCount = 0;
+  _lock.unlock();
+
+  unmapExtents( victims );
+  return released;
+}
+
+template <class P>
+void
+AllocatorT<P>::consolidateFastBins()
+{
+  // An object whose neighbour is still in a bin merges with it when the
+  // neighbour's turn comes
+  for ( int bin = 0; bin < NumFastBins; bin++ ) {
+    FreeObjectHeader * f = _fastBins[ bin ];
+    while ( f ) {
+      FreeObjectHeader * next = f->_next;
+      freeLarge( f );
+      f = next;
+    }
+    _fastBins[ bin ] = NULL;
+  }
+  _fastBytes = 0;
+  _fastCount = 0;
+}
+
+template <class P>
+void
+AllocatorT<P>::insertFree( ObjectHeader * o, size_t size )
+{
+  FreeChunk * chunk = _chunkPool.get();
+  if ( chunk == NULL ) {
+    // No memory for the entry. Leave the object marked allocated, so it
+    // is lost but neither handed out nor coalesced
+    setObject( o, size, ObjAllocated );
+    return;
+  }
+
+  setObject( o, size, ObjFree );
+  ( (FreeObjectHeader *) o )->_chunk = chunk;
+  chunk->_object = o;
+  chunk->_objectSize = size;
+
+  // The chunk goes after prev, or first if prev is NULL
+  FreeChunk * prev = NULL;
+  if ( _options._placement == PlaceAddress ) {
+    for ( FreeChunk * c = _freeList; c && c->_object < o; c = c->_next ) {
+      prev = c;
+    }
+  }
+  chunk->_prev = prev;
+  chunk->_next = prev ? prev->_next : _freeList;
+  if ( chunk->_next ) {
+    chunk->_next->_prev = chunk;
+  }
+  if ( prev ) {
+    prev->_next = chunk;
+  }
+  else {
+    _freeList = chunk;
+  }
+  indexChunk( chunk );
+  _freeBytes += size;
+  _freeCount++;
+}
+
+template <class P>
+void
+AllocatorT<P>::removeFree( FreeChunk * chunk )
+{
+  if ( chunk->_prev ) {
+    chunk->_prev->_next = chunk->_next;
+  }
+  else {
+    _freeList = chunk->_next;
+  }
+  if ( chunk->_next ) {
+    chunk->_next->_prev = chunk->_prev;
+  }
+  if ( _rover == chunk ) {
+    _rover = chunk->_next;
+  }
+  unindexChunk( chunk );
+  _freeBytes -= chunk->_objectSize;
+  _freeCount--;
+  _chunkPool.put( chunk );
+}
+
+template <class P>
+void
+AllocatorT<P>::reindexFree( int placement )
+{
+  int current = _options._placement;
+  _options._placement = placement;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    unindexChunk( c );
+  }
+  _options._placement = current;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    indexChunk( c );
+  }
+  _rover = NULL;
+}
+
+template <class P>
+void
+AllocatorT<P>::setUpPool()
+{
+  _lock.lock();
+  if ( _fastBytes ) {
+    consolidateFastBins();
+  }
+  if ( growHeap( _options._poolBytes ) ) {
+    // The new memory is the free object at the top of the last segment.
+    // Its links and footer are already written
+    char * end = _lastSegment->_end - sizeof(ObjectHeader);
+    char * start = end - topFreeSize();
+    for ( char * p = start + PageSize; p < end; p += PageSize ) {
+      *(volatile char *) p = 0;
+    }
+
+    // Every object that fits in the pool is placed in it rather than
+    // mapped, or carved from the buddy heap, which maps its roots. There
+    // is at most one free chunk per object in use, and only memalign
+    // puts objects of MaxSmallSize or less here, so entries for that many
+    // chunks are mapped now too
+    if ( _options._mmapThreshold < _options._poolBytes ) {
+      _options._mmapThreshold = _options._poolBytes;
+    }
+    _options._buddyReserve = 0;
+    _chunkPool.reserve( _options._poolBytes / MaxSmallSize + 1 );
+  }
+  _lock.unlock();
+}
+
+template <class P>
+FreeChunk *
+AllocatorT<P>::findFree( size_t size )
+{
+  FreeChunk * found = NULL;
+  size_t steps = 0;
+
+  if ( _options._placement == PlaceTlsf ) {
+    _searches++;
+    _searchSteps++;
+    return _bins.fit( size );
+  }
+
+  if ( size >= TreeMinSize ) {
+    found = _tree.fit( size, steps );
+    _searches++;
+    _searchSteps += steps;
+    return found;
+  }
+
+  switch ( _options._placement ) {
+  case PlaceNext: {
+    // From the rover to the end, then from the start up to the rover
+    FreeChunk * start = _rover ? _rover : _freeList;
+    for ( FreeChunk * c = start; c && found == NULL; c = c->_next ) {
+      steps++;
+      if ( c->_objectSize >= size ) {
+        found = c;
+      }
+    }
+    for ( FreeChunk * c = _freeList; c != start && found == NULL;
+          c = c->_next ) {
+      steps++;
+      if ( c->_objectSize >= size ) {
+        found = c;
+      }
+    }
+    _rover = found;
+    break;
+  }
+
+  case PlaceBest:
+    for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+      steps++;
+      if ( c->_objectSize >= size &&
+           ( found == NULL || c->_objectSize < found->_objectSize ) ) {
+        found = c;
+        if ( c->_objectSize == size ) {
+          break;
+        }
+      }
+    }
+    break;
+
+  case PlaceWorst:
+    found = _tree.largest( steps );
+    for ( FreeChunk * c = found ? NULL : _freeList; c; c = c->_next ) {
+      steps++;
+      if ( found == NULL || c->_objectSize > found->_objectSize ) {
+        found = c;
+      }
+    }
+    if ( found && found->_objectSize < size ) {
+      found = NULL;
+    }
+    break;
+
+  default:
+    // First fit, from the newest chunk or from the lowest address
+    for ( FreeChunk * c = _freeList; c && found == NULL; c = c->_next ) {
+      steps++;
+      if ( c->_objectSize >= size ) {
+        found = c;
+      }
+    }
+    break;
+  }
+
+  _searches++;
+  _searchSteps += steps;
+  return found;
+}
+
+template <class P>
+ObjectHeader *
+AllocatorT<P>::freeLarge( ObjectHeader * o )
+{
+  size_t size = o->_objectSize;
+
+  // Coalesce with the previous object using its footer
+  ObjectFooter * prevFooter = (ObjectFooter *) o - 1;
+  if ( prevFooter->_flags == ObjFree ) {
+    ObjectHeader * prev =
+      (ObjectHeader *) ( (char *) o - prevFooter->_objectSize );
+    removeFree( chunkOf( prev ) );
+    size += prev->_objectSize;
+    if ( _checkObject == o ) {
+      _checkObject = prev;
+    }
+    o = prev;
+  }
+
+  // Coalesce with the next object using its header
+  ObjectHeader * next = (ObjectHeader *) ( (char *) o + size );
+  if ( next->_flags == ObjFree ) {
+    removeFree( chunkOf( next ) );
+    size += next->_objectSize;
+    if ( _checkObject == next ) {
+      _checkObject = o;
+    }
+  }
+
+  insertFree( o, size );
+  return o;
+}
+
+template <class P>
+void *
+AllocatorT<P>::allocateAligned( size_t alignment, size_t size )
+{
+  if ( alignment <= SmallGranularity ) {
+    return allocateObject( size );
+  }
+
+  // Slabs start on a page and small classes are multiples of
+  // SmallGranularity, so a size that is a multiple of the alignment lands
+  // on an aligned object.
+  size_t rounded = ( size + alignment - 1 ) & ~( alignment - 1 );
+  if ( rounded < size ) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ( alignment <= PageSize && rounded <= MaxSmallSize &&
+       classSize( sizeClass( rounded ) ) % alignment == 0 ) {
+    return allocateObject( rounded );
+  }
+
+  // Buddy blocks are aligned to their size
+  if ( _options._buddyReserve && rounded > MaxSmallSize &&
+       rounded < _options._mmapThreshold ) {
+    void * block = allocateBuddy( rounded > alignment ? rounded : alignment );
+    if ( block ) {
+      return block;
+    }
+  }
+
+  return allocateLarge( rounded, alignment );
+}
+
+template <class P>
+void
+AllocatorT<P>::checkSmallFree( Slab * slab, void * ptr )
+{
+  size_t offset = (char *) ptr - slab->_start;
+  if ( offset % slab->_objectSize != 0 ||
+       offset / slab->_objectSize >= (size_t) slab->_carved ) {
+    checkFailed( "free of a pointer inside a small object", ptr );
+  }
+  if ( slab->_owner == _threadHeap ) {
+    for ( FreeObject * o = slab->_freeList; o; o = o->_next ) {
+      if ( o == ptr ) {
+        checkFailed( "double free of a small object", ptr );
+      }
+    }
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::checkLargeFree( ObjectHeader * o )
+{
+  if ( Checking::Magic && o->_magic != AllocatedMagic ) {
+    checkFailed( o->_magic == FreeMagic ? "double free of a large object" :
+                 "bad magic in large object header", o + 1 );
+  }
+  if ( Checking::Validate && o->_flags != ObjMapped ) {
+    ObjectFooter * f = footer( o );
+    if ( o->_flags != ObjAllocated || f->_flags != ObjAllocated ||
+         f->_objectSize != o->_objectSize ) {
+      checkFailed( "boundary tags of large object do not match", o + 1 );
+    }
+  }
+}
+
+// Copy of a free object taken by checkHeapConcurrent while it holds the
+// lock, verified after the lock is released.
+class FreeObjectCopy {
+ public:
+  FreeChunk _entry;
+  FreeObjectHeader _header;
+  ObjectFooter _footer;
+  int _prevFlags;                        // Flags of the left neighbour
+  const FreeChunk * _entryAddress;
+  const ObjectHeader * _address;
+};
+
+// Sorts copies by address. Heap sort, since qsort may call malloc.
+static void
+sortCopies( FreeObjectCopy * copies, size_t count )
+{
+  struct Sift {
+    static void down( FreeObjectCopy * a, size_t root, size_t end ) {
+      while ( 2 * root + 1 < end ) {
+        size_t child = 2 * root + 1;
+        if ( child + 1 < end && a[ child ]._address < a[ child + 1 ]._address ) {
+          child++;
+        }
+        if ( a[ root ]._address >= a[ child ]._address ) {
+          return;
+        }
+        FreeObjectCopy t = a[ root ];
+        a[ root ] = a[ child ];
+        a[ child ] = t;
+        root = child;
+      }
+    }
+  };
+
+  for ( size_t i = count / 2; i > 0; i-- ) {
+    Sift::down( copies, i - 1, count );
+  }
+  for ( size_t end = count; end > 1; end-- ) {
+    FreeObjectCopy t = copies[ 0 ];
+    copies[ 0 ] = copies[ end - 1 ];
+    copies[ end - 1 ] = t;
+    Sift::down( copies, 0, end - 1 );
+  }
+}
+
+template <class P>
+bool
+AllocatorT<P>::inSegment( const void * ptr )
+{
+  for ( Segment * s = _segments; s; s = s->_next ) {
+    if ( (const char *) ptr >= s->_start && (const char *) ptr < s->_end ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class P>
+ObjectHeader *
+AllocatorT<P>::checkObject( Segment * segment, ObjectHeader * o,
+                            CheckReport & report )
+{
+  // Returns the next object of the segment, or NULL at the end fence
+  // post or when the header is too broken to find the next object.
+  char * fencePost = segment->_end - sizeof(ObjectHeader);
+  if ( (char *) o >= fencePost ) {
+    if ( (char *) o > fencePost ) {
+      report.add( "object runs past the end of its segment", o );
+    }
+    else if ( o->_flags != ObjAllocated ||
+              o->_objectSize != sizeof(ObjectHeader) ) {
+      report.add( "fence post at the end of a segment was overwritten", o );
+    }
+    return NULL;
+  }
+
+  size_t size = o->_objectSize;
+  if ( ( o->_flags != ObjFree && o->_flags != ObjAllocated &&
+         o->_flags != ObjFast ) ||
+       size < MinObjectSize || size % SmallGranularity != 0 ||
+       size > (size_t) ( fencePost - (char *) o ) ) {
+    report.add( "object header is corrupt", o );
+    return NULL;
+  }
+
+  ObjectFooter * f = footer( o );
+  int footerFlags = o->_flags == ObjFast ? (int) ObjAllocated : o->_flags;
+  if ( f->_flags != footerFlags || f->_objectSize != size ) {
+    report.add( "header and footer of object do not match", o );
+  }
+  if ( Checking::Magic &&
+       o->_magic != ( o->_flags == ObjAllocated ? AllocatedMagic : FreeMagic ) ) {
+    report.add( "bad magic number in object header", o );
+  }
+
+  if ( o->_flags == ObjFree ) {
+    FreeChunk * chunk = chunkOf( o );
+    if ( ( (ObjectFooter *) o - 1 )->_flags == ObjFree ) {
+      report.add( "adjacent free objects were not coalesced", o );
+    }
+    if ( !_chunkPool.owns( chunk ) || chunk->_object != o ||
+         chunk->_objectSize != size ) {
+      report.add( "free object and its free list entry do not match", o );
+    }
+    else {
+      if ( chunk->_prev ? !_chunkPool.owns( chunk->_prev ) ||
+                          chunk->_prev->_next != chunk
+                        : _freeList != chunk ) {
+        report.add( "previous link of free object is broken", o );
+      }
+      if ( chunk->_next && ( !_chunkPool.owns( chunk->_next ) ||
+                             chunk->_next->_prev != chunk ) ) {
+        report.add( "next link of free object is broken", o );
+      }
+    }
+  }
+
+  return (ObjectHeader *) ( (char *) o + size );
+}
+
+template <class P>
+bool
+AllocatorT<P>::ownsLists( const Slab * slab )
+{
+  // Only the owner touches a slab's local free list, so another thread
+  // may walk it only while the owner is known to be gone. Slabs on a
+  // central list have no owner and are not walked.
+  return !Locking::ThreadSafe ||
+         ( slab->_owner && ( slab->_owner == _threadHeap ||
+                             slab->_owner->_abandoned ) );
+}
+
+template <class P>
+void
+AllocatorT<P>::checkTree( FreeChunk * t, const FreeChunk * low,
+                          const FreeChunk * high, size_t & nodes, size_t limit,
+                          CheckReport & report )
+{
+  if ( t == NULL || nodes > limit ) {
+    return;
+  }
+  if ( !_chunkPool.owns( t ) ) {
+    report.add( "size tree entry is not in the entry pool", t );
+    nodes = limit + 1;
+    return;
+  }
+  nodes++;
+  ObjectHeader * o = t->_object;
+  if ( !inSegment( o ) || o->_flags != ObjFree || chunkOf( o ) != t ||
+       t->_objectSize < TreeMinSize ) {
+    report.add( "size tree points to an object that is not a large free one", o );
+  }
+  if ( ( low && ( low->_objectSize > t->_objectSize ||
+                  ( low->_objectSize == t->_objectSize &&
+                    low->_object >= t->_object ) ) ) ||
+       ( high && ( t->_objectSize > high->_objectSize ||
+                   ( t->_objectSize == high->_objectSize &&
+                     t->_object >= high->_object ) ) ) ) {
+    report.add( "size tree is out of order", o );
+  }
+  checkTree( t->_left, low, t, nodes, limit, report );
+  checkTree( t->_right, t, high, nodes, limit, report );
+}
+
+template <class P>
+void
+AllocatorT<P>::checkBins( size_t listed, CheckReport & report )
+{
+  size_t binned = 0;
+  for ( int first = 0; first < TlsfFirstLevels; first++ ) {
+    bool any = false;
+    for ( int second = 0; second < TlsfSecondLevels; second++ ) {
+      FreeChunk * prev = NULL;
+      FreeChunk * c = _bins.head( first, second );
+      if ( ( c != NULL ) != _bins.marked( first, second ) ) {
+        report.add( "TLSF bitmap does not match its bin", c );
+      }
+      any |= c != NULL;
+      for ( ; c; c = c->_right ) {
+        int f = -1;
+        int s = -1;
+        if ( _chunkPool.owns( c ) ) {
+          TlsfBins::map( c->_objectSize, f, s );
+        }
+        if ( f != first || s != second || c->_left != prev ) {
+          report.add( "TLSF bin holds a chunk that does not belong there", c );
+          break;
+        }
+        if ( ++binned > listed ) {
+          report.add( "TLSF bins hold more chunks than the free list", c );
+          return;
+        }
+        prev = c;
+      }
+    }
+    if ( any != _bins.marked( first ) ) {
+      report.add( "TLSF first level bitmap does not match its bins", NULL );
+    }
+  }
+  if ( binned != listed ) {
+    report.add( "free list entries are missing from the TLSF bins", NULL );
+  }
+}
+
+template <class P>
+void
+AllocatorT<P>::checkBuddy( CheckReport & report )
+{
+  for ( int k = 0; k < NumBuddyOrders; k++ ) {
+    size_t size = (size_t) BuddyMinSize << k;
 
-  // # malloc calls
-  int _mallocCalls;
+    // A free block whose buddy is free too should have been merged
+    size_t free = 0;
+    size_t words = ( ( _buddyReserved >> ( BuddyMinOrder + k ) ) + 63 ) / 64;
+    for ( size_t w = 0; w < words; w++ ) {
+      uint64_t word = _buddyBits[ k ][ w ];
+      free += __builtin_popcountll( word );
+      if ( k < NumBuddyOrders - 1 &&
+           ( word & ( word >> 1 ) & 0x5555555555555555ull ) ) {
+        report.add( "buddy heap has two free buddies", _buddyStart +
+                    ( w * 64 << ( BuddyMinOrder + k ) ) );
+      }
+    }
 
-  // # free calls
-  int _freeCalls;
+    size_t listed = 0;
+    BuddyBlock * prev = NULL;
+    for ( BuddyBlock * b = _buddyLists[ k ]; b; b = b->_next ) {
+      size_t offset = (char *) b - _buddyStart;
+      if ( offset >= _buddySize || ( offset & ( size - 1 ) ) ||
+           ( buddyWord( k, offset ) & buddyBit( k, offset ) ) == 0 ||
+           _buddyOrders[ offset >> BuddyMinOrder ] != 0 || b->_prev != prev ) {
+        report.add( "buddy free list holds a block that is not free", b );
+        break;
+      }
+      if ( ++listed > free ) {
+        break;
+      }
+      prev = b;
+    }
+    if ( listed != free ) {
+      report.add( "buddy free list and bitmap disagree", _buddyLists[ k ] );
+    }
+  }
+}
 
-  // # realloc calls
-  int _reallocCalls;
-  
-  // # realloc calls
-  int _callocCalls;
-  
-public:
-  // This is the only instance of the allocator.
-  static Allocator TheAllocator;
+template <class P>
+void
+AllocatorT<P>::checkSlab( const Slab * slab, const Slab * address,
+                          bool walkLists, CheckReport & report )
+{
+  int c = slab->_sizeClass;
+  if ( c < 0 || c >= NumSizeClasses ) {
+    report.add( "slab has a bad size class", address );
+    return;
+  }
+  const SizeClassInfo & info = TheSizeClasses._info[ c ];
 
-  //Initializes the heap
-  void initialize();
+  char * start = slab->_start;
+  if ( (uintptr_t) start & ( PageSize - 1 ) ) {
+    report.add( "slab does not start on a page", address );
+    return;
+  }
+  if ( address && ( _pageMap.lookup( start ) != address ||
+                    _pageMap.lookup( start + info._slabSize - 1 ) != address ) ) {
+    report.add( "page map does not point to slab", start );
+  }
+  if ( slab->_objectSize != info._size ||
+       slab->_capacity != (int) info._objectsPerSlab ) {
+    report.add( "slab geometry does not match its size class", start );
+  }
 
-  // Allocates an object 
-  void * allocateObject( size_t size );
+  // The owner bumps _carved before _used, so reading in this order
+  // never sees used > carved on a healthy slab.
+  int used = slab->_used;
+  int carved = slab->_carved;
+  if ( carved < 0 || carved > slab->_capacity ) {
+    report.add( "slab carved count out of range", start );
+    return;
+  }
+  if ( used < 0 || used > carved ) {
+    report.add( "slab used count out of range", start );
+    return;
+  }
 
-  // Frees an object
-  void freeObject( void * ptr );
+  if ( !walkLists ) {
+    return;
+  }
 
-  // Returns the size of an object
-  size_t objectSize( void * ptr );
+  int free = 0;
+  for ( FreeObject * o = slab->_freeList; o; o = o->_next ) {
+    size_t offset = (char *) o - start;
+    if ( (char *) o < start || offset % slab->_objectSize != 0 ||
+         offset / slab->_objectSize >= (size_t) carved ) {
+      report.add( "slab free list points outside the slab's objects", o );
+      return;
+    }
+    if ( ++free > carved ) {
+      report.add( "slab free list has a cycle", start );
+      return;
+    }
+  }
+  if ( free + used != carved ) {
+    report.add( "slab free list length does not match its counts", start );
+  }
+}
 
-  // At exit handler
-  void atExitHandler();
+template <class P>
+size_t
+AllocatorT<P>::deliver( CheckReport & report )
+{
+  size_t n = report._count;
+  if ( n > (size_t) CheckReport::MaxErrors ) {
+    n = CheckReport::MaxErrors;
+  }
+  for ( size_t i = 0; i < n; i++ ) {
+    if ( _checkCallback ) {
+      _checkCallback( report._messages[ i ], report._addresses[ i ],
+                      _checkCallbackArg );
+    }
+    else {
+      // Without a callback, behave like the assert the handout asks for
+      checkFailed( report._messages[ i ], report._addresses[ i ] );
+    }
+  }
+  return report._count;
+}
 
-  //Prints the heap size and other information about the allocator
-  void print();
+template <class P>
+size_t
+AllocatorT<P>::checkHeap()
+{
+  CheckReport report;
 
-  // Gets memory from the OS
-  void * getMemoryFromOS( size_t size );
+  _lock.lock();
 
-  void increaseMallocCalls() { _mallocCalls++; }
+  size_t freeObjects = 0;
+  size_t fastObjects = 0;
+  for ( Segment * s = _segments; s; s = s->_next ) {
+    ObjectFooter * fence = (ObjectFooter *) s->_start;
+    if ( fence->_flags != ObjAllocated ) {
+      report.add( "fence post at the start of a segment was overwritten", fence );
+    }
+    ObjectHeader * o = (ObjectHeader *) ( fence + 1 );
+    while ( o ) {
+      ObjectHeader * next = checkObject( s, o, report );
+      if ( next && o->_flags == ObjFree ) {
+        freeObjects++;
+      }
+      if ( next && o->_flags == ObjFast ) {
+        fastObjects++;
+      }
+      o = next;
+    }
+  }
 
-  void increaseReallocCalls() { _reallocCalls++; }
+  size_t listed = 0;
+  size_t large = 0;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    if ( !_chunkPool.owns( c ) ) {
+      report.add( "free list entry is not in the entry pool", c );
+      break;
+    }
+    ObjectHeader * o = c->_object;
+    if ( !inSegment( o ) || o->_flags != ObjFree || chunkOf( o ) != c ) {
+      report.add( "free list points to an object that is not free", o );
+      break;
+    }
+    if ( ++listed > freeObjects ) {
+      report.add( "free list has more entries than there are free objects", o );
+      break;
+    }
+    if ( c->_objectSize >= TreeMinSize && _options._placement != PlaceTlsf ) {
+      large++;
+    }
+  }
+  if ( listed < freeObjects ) {
+    report.add( "free objects are missing from the free list", _freeList );
+  }
+  size_t nodes = 0;
+  checkTree( _tree.root(), NULL, NULL, nodes, large, report );
+  if ( nodes != large ) {
+    report.add( "size tree does not hold the large free chunks", _tree.root() );
+  }
+  if ( _options._placement == PlaceTlsf ) {
+    checkBins( listed, report );
+  }
+  if ( _buddyStart ) {
+    checkBuddy( report );
+  }
 
-  void increaseCallocCalls() { _callocCalls++; }
+  size_t binned = 0;
+  for ( int bin = 0; bin < NumFastBins; bin++ ) {
+    for ( FreeObjectHeader * f = _fastBins[ bin ]; f; f = f->_next ) {
+      if ( !inSegment( f ) || f->_flags != ObjFast ||
+           f->_objectSize / FastBinStep != (size_t) bin ) {
+        report.add( "fast bin holds an object that does not belong there", f );
+        break;
+      }
+      if ( ++binned > fastObjects ) {
+        report.add( "fast bins have more entries than there are fast objects", f );
+        break;
+      }
+    }
+  }
+  if ( binned < fastObjects ) {
+    report.add( "fast objects are missing from the fast bins", NULL );
+  }
 
-  void increaseFreeCalls() { _freeCalls++; }
+  for ( Slab * slab = _allSlabs; slab; slab = slab->_nextAll ) {
+    checkSlab( slab, slab, ownsLists( slab ), report );
+  }
 
-};
+  size_t cached = 0;
+  for ( Extent * e = _extents; e && cached <= _cachedBytes; e = e->_next ) {
+    if ( ( e->_next ? e->_next->_prev : _oldestExtent ) != e ||
+         ( e->_next && e->_next->_freedAt > e->_freedAt ) ) {
+      report.add( "extent cache list is broken", e->_start );
+      break;
+    }
+    cached += e->_size;
+  }
+  if ( cached != _cachedBytes ) {
+    report.add( "extent cache byte count is wrong", _extents );
+  }
 
-Allocator Allocator::TheAllocator;
+  _lock.unlock();
 
-extern "C" void
-atExitHandlerInC()
-{
-  Allocator::TheAllocator.atExitHandler();
+  return deliver( report );
 }
 
-void
-Allocator::initialize()
+template <class P>
+size_t
+AllocatorT<P>::checkHeapIncremental( size_t maxObjects )
 {
-  // Environment var VERBOSE prints stats at end and turns on debugging
-  // Default is on
-  _verbose = 1;
-  const char * envverbose = getenv( "MALLOCVERBOSE" );
-  if ( envverbose && !strcmp( envverbose, "NO") ) {
-    _verbose = 0;
+  CheckReport report;
+
+  _lock.lock();
+
+  // A pass checks the objects of every segment and then every slab. A
+  // call starts at most one new pass.
+  bool started = false;
+  size_t budget = maxObjects;
+  while ( budget > 0 ) {
+    if ( _checkSegment ) {
+      ObjectHeader * next = checkObject( _checkSegment, _checkObject, report );
+      budget--;
+      if ( next ) {
+        _checkObject = next;
+        continue;
+      }
+      _checkSegment = _checkSegment->_next;
+      if ( _checkSegment ) {
+        _checkObject = (ObjectHeader *) ( _checkSegment->_start +
+                                          sizeof(ObjectFooter) );
+      }
+      else {
+        _checkSlab = _allSlabs;
+        if ( _checkSlab == NULL ) {
+          break;
+        }
+      }
+    }
+    else if ( _checkSlab ) {
+      checkSlab( _checkSlab, _checkSlab, ownsLists( _checkSlab ), report );
+      budget--;
+      _checkSlab = _checkSlab->_nextAll;
+    }
+    else {
+      if ( started ) {
+        break;
+      }
+      started = true;
+      _checkSegment = _segments;
+      if ( _checkSegment ) {
+        _checkObject = (ObjectHeader *) ( _checkSegment->_start +
+                                          sizeof(ObjectFooter) );
+      }
+      else {
+        _checkSlab = _allSlabs;
+        if ( _checkSlab == NULL ) {
+          break;
+        }
+      }
+    }
   }
 
-  // In verbose mode register also printing statistics at exit
-  atexit( atExitHandlerInC );
+  _lock.unlock();
 
-  _initialized = 1;
+  return deliver( report );
 }
 
-void *
-Allocator::allocateObject( size_t size )
+template <class P>
+size_t
+AllocatorT<P>::checkHeapConcurrent()
 {
-  // Simple implementation
+  CheckReport report;
 
-  //Make sure that allocator is initialized
-  if ( !_initialized ) {
-    initialize();
-  }
+  // Size the snapshot without holding the lock while mmap runs, then
+  // copy. Retry if the heap grew in between.
+  char * buffer = NULL;
+  size_t bufferSize = 0;
+  size_t nfree = 0;
+  size_t nslabs = 0;
+  for ( ;; ) {
+    _lock.lock();
+    size_t wantFree = 0;
+    size_t wantSlabs = 0;
+    for ( FreeChunk * c = _freeList; c && _chunkPool.owns( c ); c = c->_next ) {
+      if ( ++wantFree > _heapSize / MinObjectSize ) {
+        break;
+      }
+    }
+    for ( Slab * slab = _allSlabs; slab; slab = slab->_nextAll ) {
+      wantSlabs++;
+    }
+    if ( buffer && wantFree <= nfree && wantSlabs <= nslabs ) {
+      break;
+    }
+    _lock.unlock();
 
-  // Add the ObjectHeader to the size and round the total size up to a
-  // multiple of 8 bytes for alignment.
-  size_t totalSize = (size + sizeof(ObjectHeader) + 7) & ~7;
+    if ( buffer ) {
+      munmap( buffer, bufferSize );
+    }
+    nfree = wantFree * 2 + 16;
+    nslabs = wantSlabs * 2 + 16;
+    bufferSize = nslabs * ( sizeof(Slab) + sizeof(Slab *) ) +
+                 nfree * sizeof(FreeObjectCopy);
+    bufferSize = ( bufferSize + PageSize - 1 ) & ~(size_t) ( PageSize - 1 );
+    buffer = (char *) mmap( NULL, bufferSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( buffer == MAP_FAILED ) {
+      return 0;
+    }
+  }
 
-  // You should get memory from the OS only if the memory in the free list could not
-  // satisfy the request.
+  // Copy with the lock held. Only what is needed to read memory safely
+  // is checked here.
+  Slab * slabs = (Slab *) buffer;
+  const Slab ** originals = (const Slab **) ( slabs + nslabs );
+  FreeObjectCopy * copies = (FreeObjectCopy *) ( originals + nslabs );
+  size_t ncopies = 0;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    if ( !_chunkPool.owns( c ) ) {
+      report.add( "free list entry is not in the entry pool", c );
+      break;
+    }
+    char * start = (char *) c->_object;
+    char * end = start + c->_objectSize;
+    if ( c->_objectSize < MinObjectSize || !inSegment( start ) ||
+         !inSegment( end - 1 ) ) {
+      report.add( "free list points outside the heap", start );
+      break;
+    }
+    if ( ncopies == nfree ) {
+      report.add( "free list has a cycle", start );
+      break;
+    }
+    FreeObjectCopy & copy = copies[ ncopies++ ];
+    memcpy( (void *) &copy._entry, c, sizeof(FreeChunk) );
+    memcpy( (void *) &copy._header, start, sizeof(FreeObjectHeader) );
+    memcpy( (void *) &copy._footer, end - sizeof(ObjectFooter),
+            sizeof(ObjectFooter) );
+    copy._prevFlags = ( (ObjectFooter *) start - 1 )->_flags;
+    copy._entryAddress = c;
+    copy._address = c->_object;
+  }
+  size_t ncopiedSlabs = 0;
+  for ( Slab * slab = _allSlabs; slab; slab = slab->_nextAll ) {
+    memcpy( (void *) &slabs[ ncopiedSlabs ], (void *) slab, sizeof(Slab) );
+    originals[ ncopiedSlabs++ ] = slab;
+  }
+  _lock.unlock();
 
-  // Simple allocator always gets memory from the OS.
-  void * mem = getMemoryFromOS( totalSize );
+  // Everything below runs while other threads keep allocating.
+  for ( size_t i = 0; i < ncopies; i++ ) {
+    FreeObjectCopy & c = copies[ i ];
+    size_t size = c._entry._objectSize;
+    if ( c._header._flags != ObjFree || c._footer._flags != ObjFree ||
+         c._header._objectSize != size || c._footer._objectSize != size ) {
+      report.add( "free list object is not marked free in both tags", c._address );
+    }
+    if ( c._header._chunk != c._entryAddress ) {
+      report.add( "free object and its free list entry do not match", c._address );
+    }
+    if ( size < MinObjectSize || size % SmallGranularity != 0 ) {
+      report.add( "free object has a bad size", c._address );
+    }
+    if ( Checking::Magic && c._header._magic != FreeMagic ) {
+      report.add( "bad magic number in free object", c._address );
+    }
+    if ( c._prevFlags == ObjFree ) {
+      report.add( "adjacent free objects were not coalesced", c._address );
+    }
+    const FreeChunk * prev = i > 0 ? copies[ i - 1 ]._entryAddress : NULL;
+    if ( c._entry._prev != prev ) {
+      report.add( "previous link of free object is broken", c._address );
+    }
+  }
 
-  // Get a pointer to the object header
-  ObjectHeader * o = (ObjectHeader *) mem;
+  sortCopies( copies, ncopies );
+  for ( size_t i = 1; i < ncopies; i++ ) {
+    const char * end = (const char *) copies[ i - 1 ]._address +
+                       copies[ i - 1 ]._entry._objectSize;
+    if ( end > (const char *) copies[ i ]._address ) {
+      report.add( "free objects overlap", copies[ i ]._address );
+    }
+    else if ( end == (const char *) copies[ i ]._address ) {
+      report.add( "adjacent free objects were not coalesced", copies[ i ]._address );
+    }
+  }
 
-  // Store the totalSize. We will need it in realloc() and in free()
-  o->_objectSize = totalSize;
+  for ( size_t i = 0; i < ncopiedSlabs; i++ ) {
+    // A slab released since the copy no longer maps to itself
+    if ( _pageMap.lookup( slabs[ i ]._start ) == originals[ i ] ) {
+      checkSlab( &slabs[ i ], NULL, false, report );
+    }
+  }
 
-  // Set object as allocated
-  o->_flags = ObjAllocated;
+  munmap( buffer, bufferSize );
 
-  // Return the pointer after the object header.
-  return (void *) (o + 1);
+  return deliver( report );
 }
 
+template <class P>
 void
-Allocator::freeObject( void * ptr )
+AllocatorT<P>::freeObject( void * ptr )
 {
-  // Here you will return the object to the free list sorted by address and you will coalesce it
-  // if possible.
+  Slab * slab = _pageMap.lookup( ptr );
+  if ( slab ) {
+    if ( Checking::Validate ) {
+      checkSmallFree( slab, ptr );
+    }
+    if ( Checking::Poison ) {
+      memset( ptr, 0xdf, slab->_objectSize );
+    }
+
+    FreeObject * o = (FreeObject *) ptr;
+    if ( !Locking::ThreadSafe ||
+         ( slab->_owner != NULL && slab->_owner == _threadHeap ) ) {
+      o->_next = slab->_freeList;
+      slab->_freeList = o;
+      if ( slab->_full.load( std::memory_order_relaxed ) &&
+           slab->_full.exchange( 0, std::memory_order_acq_rel ) ) {
+        ThreadHeap * heap = slab->_owner;
+        slab->_used--;
+        slab->_next = heap->_slabs[ slab->_sizeClass ];
+        __atomic_store_n( &heap->_slabs[ slab->_sizeClass ], slab,
+                          __ATOMIC_RELEASE );
+      }
+      else {
+        // Last, since the scavenger may take the slab once it is empty
+        __atomic_store_n( &slab->_used, slab->_used - 1, __ATOMIC_RELEASE );
+      }
+    }
+    else if ( _threadHeap && slab->_owner != NULL ) {
+      // The slab cannot change hands while this object is in use, so a
+      // batch holds objects of one heap's slabs only
+      ThreadHeap * heap = _threadHeap;
+      int c = slab->_sizeClass;
+      if ( heap->_remoteOwner[ c ] != slab->_owner ) {
+        if ( heap->_remote[ c ] ) {
+          flushRemote( heap, c );
+        }
+        heap->_remoteOwner[ c ] = slab->_owner;
+      }
+      o->_next = heap->_remote[ c ];
+      heap->_remote[ c ] = o;
+      if ( ++heap->_remoteCount[ c ] == (int) TheSizeClasses._info[ c ]._batchSize ) {
+        flushRemote( heap, c );
+      }
+    }
+    else {
+      freeRemote( slab, o );
+    }
+    return;
+  }
+
+  if ( inBuddy( ptr ) ) {
+    freeBuddy( ptr );
+    return;
+  }
+
+  // Return the object to the free list and coalesce it if possible.
+  ObjectHeader * o = (ObjectHeader *) ptr - 1;
+  if ( Checking::Magic || Checking::Validate ) {
+    checkLargeFree( o );
+  }
+  if ( o->_flags == ObjMapped ) {
+    freeMapped( o );
+    return;
+  }
+  if ( Checking::Poison ) {
+    memset( ptr, 0xdf, o->_objectSize - ObjectOverhead );
+  }
+
+  _lock.lock();
+  if ( o->_objectSize < FastBinMaxSize && _options._placement != PlaceTlsf ) {
+    pushFast( o );
+    if ( _fastBytes > _heapSize / FastBinFraction ) {
+      consolidateFastBins();
+    }
+  }
+  else if ( _options._poolBytes ) {
+    // Only malloc_trim gives a pool's pages back, so that free makes no
+    // system call
+    freeLarge( o );
+  }
+  else {
+    // Segments that are not contiguous are never merged, so their free
+    // objects stay smaller
+    size_t purgeSize = PageSource::Contiguous ? _options._trimThreshold :
+                                                (size_t) ArenaGrowth / 2;
 
-  // Simple allocator does nothing.
+    // Pages of the object and of neighbours too small to have been
+    // purged before, leaving the merged object's links and footer
+    char * start = (char *) ( (FreeObjectHeader *) o + 1 );
+    char * end = (char *) footer( o );
+    ObjectFooter * prevFooter = (ObjectFooter *) o - 1;
+    if ( prevFooter->_flags == ObjFree && prevFooter->_objectSize < purgeSize ) {
+      start = (char *) o - prevFooter->_objectSize + sizeof(FreeObjectHeader);
+    }
+    ObjectHeader * next = (ObjectHeader *) ( (char *) o + o->_objectSize );
+    if ( next->_flags == ObjFree && next->_objectSize < purgeSize ) {
+      end = (char *) footer( next );
+    }
+
+    if ( freeLarge( o )->_objectSize >= purgeSize ) {
+      purgePages( start, end );
+    }
+  }
+  if ( PageSource::Contiguous && _options._poolBytes == 0 &&
+       topFreeSize() > _options._trimThreshold ) {
+    trimTop( _options._trimPad );
+  }
+  _lock.unlock();
 }
 
+template <class P>
 size_t
-Allocator::objectSize( void * ptr )
+AllocatorT<P>::objectSize( void * ptr )
 {
+  Slab * slab = _pageMap.lookup( ptr );
+  if ( slab ) {
+    return slab->_objectSize;
+  }
+  if ( inBuddy( ptr ) ) {
+    return (size_t) 1 << _buddyOrders[ ( (char *) ptr - _buddyStart ) >>
+                                       BuddyMinOrder ];
+  }
+
   // Return the size of the object pointed by ptr. We assume that ptr is a valid obejct.
   ObjectHeader * o =
     (ObjectHeader *) ( (char *) ptr - sizeof(ObjectHeader) );
+  if ( o->_flags == ObjMapped ) {
+    return o->_objectSize - sizeof(ObjectHeader);
+  }
+
+  // Substract the size of the header and footer
+  return o->_objectSize - ObjectOverhead;
+}
+
+template <class P>
+void
+AllocatorT<P>::getInfo( HeapInfo & info )
+{
+  memset( &info, 0, sizeof(info) );
+
+  _lock.lock();
+  info._heapSize = _heapSize;
+  info._maxHeapSize = _maxHeapSize;
+  info._freeBytes = _freeBytes;
+  info._freeCount = _freeCount;
+  info._fastBytes = _fastBytes;
+  info._fastCount = _fastCount;
+  info._topFree = topFreeSize();
+  info._cachedBytes = _cachedBytes;
+  info._cachedCount = _cachedCount;
+  info._slabBytes = _slabBytes;
+  info._slabCount = _slabCount;
+  info._threadCacheBytes = _threadCacheBytes;
+  info._threadCacheBudget = _options._threadCacheBytes;
+  info._buddyBytes = _buddySize;
+  info._buddyFreeBytes = _buddyFreeBytes;
+  info._buddyFreeCount = _buddyFreeCount;
+  Slab * slab = _allSlabs;
+  _lock.unlock();
 
-  // Substract the size of the header
-  return o->_objectSize - sizeof(ObjectHeader);
+  info._mappedBytes = _mappedBytes.load( std::memory_order_relaxed );
+  info._mappedCount = _mappedCount.load( std::memory_order_relaxed );
+
+  // Batches in the transfer caches are free although their slabs count
+  // them as used. Batches left by exiting threads make this approximate
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    size_t objects = __atomic_load_n( &_transfer[ c ]._count, __ATOMIC_RELAXED ) *
+                     TheSizeClasses._info[ c ]._batchSize;
+    info._classFree[ c ] += objects;
+    info._slabFreeBytes += objects * classSize( c );
+  }
+
+  // Owners update _used without the lock anyway, so the free objects
+  // are counted as they are seen. Descriptors of released slabs stay in
+  // the pool, so the walk never reads unmapped memory, and it stops
+  // after the number of slabs there were; the result is approximate
+  // while other threads allocate.
+  for ( size_t i = 0; slab && i < info._slabCount; i++ ) {
+    int c = slab->_sizeClass;
+    int used = slab->_used;
+    int capacity = slab->_capacity;
+    if ( c >= 0 && c < NumSizeClasses && used >= 0 && used <= capacity ) {
+      info._classFree[ c ] += capacity - used;
+      info._slabFreeBytes += ( capacity - used ) * classSize( c );
+    }
+    slab = slab->_nextAll;
+  }
+}
+
+// Prints one line of the lock contention statistics if the lock has
+// ever made a thread wait. Returns true if it printed
+template <class Contention>
+static bool
+printContention( const char * name, size_t size, const Contention & c )
+{
+  if ( c._waits == 0 ) {
+    return false;
+  }
+  if ( size ) {
+    printf("  %s %zu:\t%zu, %zu, %zu, %.3f\n", name, size, c._waits,
+           c._spins, c._parks, c._waitNs / 1e6 );
+  }
+  else {
+    printf("  %s:\t%zu, %zu, %zu, %.3f\n", name, c._waits, c._spins,
+           c._parks, c._waitNs / 1e6 );
+  }
+  return true;
 }
 
+template <class P>
 void
-Allocator::print()
+AllocatorT<P>::print()
 {
   printf("\n-------------------\n");
 
-  printf("HeapSize:\t%d bytes\n", _heapSize );
-  printf("# mallocs:\t%d\n", _mallocCalls );
-  printf("# reallocs:\t%d\n", _reallocCalls );
-  printf("# callocs:\t%d\n", _callocCalls );
-  printf("# frees:\t%d\n", _freeCalls );
+  printf("HeapSize:\t%zu bytes\n", _heapSize );
+
+  _lock.lock();
+  printf("Extent cache:\t%zu hits, %zu misses, %zu purged, %zu unmapped, "
+         "%zu bytes cached\n", _extentHits, _extentMisses, _extentPurges,
+         _extentUnmaps, _cachedBytes );
+  printf("Thread caches:\t%zu of %zu bytes of empty slabs\n",
+         _threadCacheBytes, _options._threadCacheBytes );
+
+  // Fragmentation is the share of the free bytes outside the largest
+  // free chunk, which an allocation of that many bytes could not use
+  size_t largest = 0;
+  for ( FreeChunk * c = _freeList; c; c = c->_next ) {
+    if ( c->_objectSize > largest ) {
+      largest = c->_objectSize;
+    }
+  }
+  printf("Placement:\t%s fit, %zu searches, %.1f chunks per search, "
+         "%zu free in %zu chunks, %.1f%% fragmented\n",
+         placementNames[ _options._placement ], _searches,
+         _searches ? (double) _searchSteps / _searches : 0.0,
+         _freeBytes, _freeCount,
+         _freeBytes ? 100.0 * ( _freeBytes - largest ) / _freeBytes : 0.0 );
+  if ( _buddyStart ) {
+    printf("Buddy heap:\t%zu bytes, %zu free in %zu blocks, %zu allocations, "
+           "%.1f%% lost to rounding, %zu splits, %zu merges\n",
+           _buddySize, _buddyFreeBytes, _buddyFreeCount, _buddyAllocs,
+           _buddyGranted ?
+             100.0 * ( _buddyGranted - _buddyRequested ) / _buddyGranted : 0.0,
+           _buddySplits, _buddyMerges );
+  }
+  _lock.unlock();
+
+  if ( Stats::Enabled ) {
+    size_t totals[ NumCallKinds ] = { 0 };
+    _lock.lock();
+    for ( ThreadHeap * heap = _allHeaps; heap; heap = heap->_nextHeap ) {
+      for ( int i = 0; i < NumCallKinds; i++ ) {
+        totals[ i ] += heap->_counters[ i ];
+      }
+    }
+    _lock.unlock();
+
+    printf("# mallocs:\t%zu\n", totals[ MallocCall ] );
+    printf("# reallocs:\t%zu\n", totals[ ReallocCall ] );
+    printf("# callocs:\t%zu\n", totals[ CallocCall ] );
+    printf("# frees:\t%zu\n", totals[ FreeCall ] );
+  }
+
+  if constexpr ( Locking::Counted ) {
+    printf("Lock contention (waits, spins, parks, ms waited):\n");
+    bool waited = printContention( "page heap", 0, _lock.contention() );
+    for ( int c = 0; c < NumSizeClasses; c++ ) {
+      waited |= printContention( "central", classSize( c ),
+                                 _central[ c ]._slabs.lock().contention() );
+      waited |= printContention( "transfer", classSize( c ),
+                                 _transfer[ c ]._lock.contention() );
+    }
+    if ( !waited ) {
+      printf("  none\n");
+    }
+  }
 
   printf("\n-------------------\n");
 }
 
+template <class P>
 void *
-Allocator::getMemoryFromOS( size_t size )
+AllocatorT<P>::getMemoryFromOS( size_t size )
 {
-  // Use sbrk() to get memory from OS
+  // Callers hold _lock since sbrk is not thread safe. Keep the start
+  // aligned to SmallGranularity.
+  void * mem = PageSource::allocate( size );
+  if ( mem == NULL ) {
+    return NULL;
+  }
+
+  size_t misalign = (uintptr_t) mem & ( SmallGranularity - 1 );
+  if ( misalign ) {
+    if ( PageSource::allocate( SmallGranularity - misalign ) == NULL ) {
+      return NULL;
+    }
+    mem = (char *) mem + SmallGranularity - misalign;
+  }
+
   _heapSize += size;
-  
-  return sbrk( size );
+  if ( _heapSize > _maxHeapSize ) {
+    _maxHeapSize = _heapSize;
+  }
+  return mem;
 }
 
+template <class P>
 void
-Allocator::atExitHandler()
+AllocatorT<P>::atExitHandler()
 {
   // Print statistics when exit
-  if ( _verbose ) {
+  if ( _options._statsPrint ) {
     print();
   }
 }
@@ -205,7 +4274,7 @@ extern "C" void *
 malloc(size_t size)
 {
   Allocator::TheAllocator.increaseMallocCalls();
-  
+
   return Allocator::TheAllocator.allocateObject( size );
 }
 
@@ -213,12 +4282,12 @@ extern "C" void
 free(void *ptr)
 {
   Allocator::TheAllocator.increaseFreeCalls();
-  
+
   if ( ptr == 0 ) {
     // No object to free
     return;
   }
-  
+
   Allocator::TheAllocator.freeObject( ptr );
 }
 
@@ -226,19 +4295,22 @@ extern "C" void *
 realloc(void *ptr, size_t size)
 {
   Allocator::TheAllocator.increaseReallocCalls();
-    
+
   // Allocate new object
   void * newptr = Allocator::TheAllocator.allocateObject( size );
+  if ( newptr == 0 ) {
+    return 0;
+  }
 
   // Copy old object only if ptr != 0
   if ( ptr != 0 ) {
-    
+
     // copy only the minimum number of bytes
     size_t sizeToCopy =  Allocator::TheAllocator.objectSize( ptr );
     if ( sizeToCopy > size ) {
       sizeToCopy = size;
     }
-    
+
     memcpy( newptr, ptr, sizeToCopy );
 
     //Free old object
@@ -252,9 +4324,13 @@ extern "C" void *
 calloc(size_t nelem, size_t elsize)
 {
   Allocator::TheAllocator.increaseCallocCalls();
-    
+
   // calloc allocates and initializes
   size_t size = nelem * elsize;
+  if ( elsize != 0 && size / elsize != nelem ) {
+    errno = ENOMEM;
+    return 0;
+  }
 
   void * ptr = Allocator::TheAllocator.allocateObject( size );
 
@@ -267,19 +4343,188 @@ calloc(size_t nelem, size_t elsize)
   return ptr;
 }
 
-extern "C" void 
+// Allocates an object that starts on a cache line and shares none of its
+// cache lines with another object. Use it for counters and locks that
+// several threads write.
+extern "C" void *
+cacheAlignedMalloc(size_t size)
+{
+  Allocator::TheAllocator.increaseMallocCalls();
+
+  size = ( size + CacheLineSize - 1 ) & ~(size_t) ( CacheLineSize - 1 );
+  return Allocator::TheAllocator.allocateAligned( CacheLineSize, size );
+}
+
+extern "C" int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if ( alignment < sizeof(void *) || ( alignment & ( alignment - 1 ) ) ) {
+    return EINVAL;
+  }
+
+  Allocator::TheAllocator.increaseMallocCalls();
+
+  void * ptr = Allocator::TheAllocator.allocateAligned( alignment, size );
+  if ( ptr == 0 ) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+extern "C" void *
+memalign(size_t alignment, size_t size)
+{
+  if ( alignment & ( alignment - 1 ) ) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  Allocator::TheAllocator.increaseMallocCalls();
+
+  return Allocator::TheAllocator.allocateAligned( alignment, size );
+}
+
+extern "C" void *
+aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign( alignment, size );
+}
+
+extern "C" void *
+valloc(size_t size)
+{
+  return memalign( PageSize, size );
+}
+
+extern "C" int
+malloc_trim(size_t pad)
+{
+  return Allocator::TheAllocator.trim( pad ) > 0;
+}
+
+// glibc's statistics, from the allocator's counters. Slabs and the
+// buddy heap are part of the arena: their free objects count as free
+// space and the rest as in use. Mappings in the extent cache count as mapped regions.
+extern "C" struct mallinfo2
+mallinfo2()
+{
+  HeapInfo info;
+  Allocator::TheAllocator.getInfo( info );
+
+  struct mallinfo2 mi;
+  memset( &mi, 0, sizeof(mi) );
+  mi.arena = info._heapSize + info._buddyBytes;
+  mi.ordblks = info._freeCount + info._buddyFreeCount;
+  mi.smblks = info._fastCount;
+  mi.hblks = info._mappedCount + info._cachedCount;
+  mi.hblkhd = info._mappedBytes + info._cachedBytes;
+  mi.fsmblks = info._fastBytes;
+  mi.fordblks = info._freeBytes + info._fastBytes + info._slabFreeBytes +
+                info._buddyFreeBytes;
+  mi.uordblks = mi.arena > mi.fordblks ? mi.arena - mi.fordblks : 0;
+  mi.keepcost = info._topFree;
+  return mi;
+}
+
+// Writes the same numbers in the XML format of glibc's malloc_info,
+// with one <size> per small size class that has free objects.
+extern "C" int
+malloc_info(int options, FILE *fp)
+{
+  if ( options != 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  HeapInfo info;
+  Allocator::TheAllocator.getInfo( info );
+
+  size_t slabFreeCount = 0;
+  fprintf( fp, "<malloc version=\"1\">\n<heap nr=\"0\">\n<sizes>\n" );
+  for ( int c = 0; c < NumSizeClasses; c++ ) {
+    size_t size = Allocator::classSize( c );
+    if ( info._classFree[ c ] ) {
+      fprintf( fp, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" "
+               "count=\"%zu\"/>\n",
+               c > 0 ? Allocator::classSize( c - 1 ) + 1 : 1, size,
+               info._classFree[ c ] * size, info._classFree[ c ] );
+    }
+    slabFreeCount += info._classFree[ c ];
+  }
+  fprintf( fp, "  <unsorted total=\"%zu\" count=\"%zu\"/>\n</sizes>\n",
+           info._freeBytes, info._freeCount );
+
+  size_t restCount = info._freeCount + slabFreeCount;
+  size_t restBytes = info._freeBytes + info._slabFreeBytes;
+  size_t aspace = info._heapSize + info._mappedBytes + info._cachedBytes +
+                  info._buddyBytes;
+  for ( int total = 0; total < 2; total++ ) {
+    // The heap's own totals, then the process totals, as glibc does
+    if ( total ) {
+      fprintf( fp, "</heap>\n" );
+    }
+    fprintf( fp, "<total type=\"fast\" count=\"%zu\" size=\"%zu\"/>\n",
+             info._fastCount, info._fastBytes );
+    fprintf( fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n",
+             restCount, restBytes );
+    if ( total ) {
+      fprintf( fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n",
+               info._mappedCount, info._mappedBytes );
+      fprintf( fp, "<total type=\"cached\" count=\"%zu\" size=\"%zu\"/>\n",
+               info._cachedCount, info._cachedBytes );
+      fprintf( fp, "<total type=\"top\" size=\"%zu\"/>\n", info._topFree );
+      fprintf( fp, "<total type=\"buddy\" count=\"%zu\" size=\"%zu\" "
+               "heap=\"%zu\"/>\n",
+               info._buddyFreeCount, info._buddyFreeBytes, info._buddyBytes );
+      fprintf( fp, "<total type=\"thread-cache\" size=\"%zu\" "
+               "budget=\"%zu\"/>\n",
+               info._threadCacheBytes, info._threadCacheBudget );
+    }
+    fprintf( fp, "<system type=\"current\" size=\"%zu\"/>\n", info._heapSize );
+    fprintf( fp, "<system type=\"max\" size=\"%zu\"/>\n", info._maxHeapSize );
+    fprintf( fp, "<aspace type=\"total\" size=\"%zu\"/>\n",
+             total ? aspace : info._heapSize );
+    fprintf( fp, "<aspace type=\"mprotect\" size=\"%zu\"/>\n",
+             total ? aspace : info._heapSize );
+  }
+  fprintf( fp, "</malloc>\n" );
+  return 0;
+}
+
+extern "C" size_t
+malloc_usable_size(void *ptr)
+{
+  if ( ptr == 0 ) {
+    return 0;
+  }
+  return Allocator::TheAllocator.objectSize( ptr );
+}
+
+extern "C" void
 checkHeap()
 {
-	// Verifies the heap consistency by iterating over all objects
-	// in the free lists and checking that the next, previous pointers
-	// size, and boundary tags make sense.
-	// The checks are done by calling assert( expr ), where "expr"
-	// is a condition that should be always true for an object.
-	//
-	// assert will print the file and line number and abort
-	// if the expression "expr" is false.
-	//
-	// checkHeap() is required for your project and also it will be 
-	// useful for debugging.
+  // Verifies the heap consistency by iterating over all objects and
+  // checking that the next, previous pointers, size, and boundary tags
+  // make sense. Errors go to the callback set with setHeapCheckCallback;
+  // without one, the first error aborts.
+  Allocator::TheAllocator.checkHeap();
+}
+
+extern "C" size_t
+checkHeapIncremental( size_t maxObjects )
+{
+  return Allocator::TheAllocator.checkHeapIncremental( maxObjects );
+}
+
+extern "C" size_t
+checkHeapConcurrent()
+{
+  return Allocator::TheAllocator.checkHeapConcurrent();
 }
 
+extern "C" void
+setHeapCheckCallback( HeapCheckCallback callback, void * arg )
+{
+  Allocator::TheAllocator.setCheckCallback( callback, arg );
+}
@@ -0,0 +1,75 @@
+//
+// Functions MyMalloc provides on top of the standard malloc interface.
+// Programs that call them must run with the allocator loaded.
+//
+
+#ifndef MYMALLOC_H
+#define MYMALLOC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called once for every error a heap check finds, after the allocator
+// lock has been released, so it may allocate.
+typedef void (*HeapCheckCallback)( const char * message, const void * address,
+                                   void * arg );
+
+// Sets the callback of the heap checks. With none set, the first error
+// prints a message and aborts.
+void setHeapCheckCallback( HeapCheckCallback callback, void * arg );
+
+// Verifies every object, the free list and every slab.
+void checkHeap( void );
+
+// Verifies at most maxObjects objects or slabs, resuming where the last
+// call stopped. Setting MALLOCCHECK=n in the environment makes every
+// large allocation call it with n. Returns the number of errors.
+size_t checkHeapIncremental( size_t maxObjects );
+
+// Copies the free list and slab descriptors under the lock and verifies
+// the copy while other threads keep allocating. Returns the number of
+// errors.
+size_t checkHeapConcurrent( void );
+
+// Configuration read once at startup, before the program's constructors,
+// as "key:value,key:value". A program sets it by defining this variable;
+// the MYMALLOC_CONF environment variable is applied after it. When the
+// allocator is preloaded, link the program with -rdynamic so that the
+// allocator sees the definition. Keys:
+//
+//   mmap_threshold:<size>   Large objects of this size get their own mapping
+//   extent_cache:<size>     Bytes of freed mappings kept for reuse
+//   extent_purge_ms:<n>     Idle time after which a cached mapping is purged
+//   extent_unmap_ms:<n>     Idle time after which it is unmapped
+//   trim_threshold:<size>   Free bytes at the top that trigger a trim
+//   trim_pad:<size>         Free bytes a trim leaves at the top
+//   thread_cache:<size>     Bytes of empty slabs all threads may keep
+//   thread_idle_ms:<n>      Idle time after which a thread's cache is
+//                           reclaimed; 0 never
+//   thp:default|always|never  Transparent huge pages for new memory
+//   placement:first|next|best|worst|address|tlsf
+//                           How large objects are placed in the free list
+//   buddy:<size>            Address space for a buddy heap that serves
+//                           large objects below mmap_threshold; 0 none
+//   pool:<size>             Heap grown and faulted in at startup; free
+//                           then never returns memory to the OS. Raises
+//                           mmap_threshold to the pool size and turns
+//                           the buddy heap off
+//   stats_print:true|false  Print statistics at exit, like MALLOCVERBOSE
+//   check:<n>               Objects checked per large allocation, like
+//                           MALLOCCHECK
+//
+// Sizes take a k, m or g suffix.
+extern const char * mymalloc_conf;
+
+// Allocates an object that starts on a cache line.
+void * cacheAlignedMalloc( size_t size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,477 @@
+//
+// Policies that AllocatorT in MyMalloc.cc is built from. Each policy is a
+// class with only static members or small nested types, and every choice
+// is a compile-time constant so that a disabled feature costs nothing on
+// the fast path. The Makefile builds one .so per combination it cares
+// about by defining MYMALLOC_LOCKING, MYMALLOC_STATS, MYMALLOC_CHECKING,
+// MYMALLOC_PLACEMENT and MYMALLOC_PAGE_SOURCE.
+//
+
+#ifndef MYMALLOC_POLICIES_H
+#define MYMALLOC_POLICIES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+//
+// Locking
+//
+// A zero-filled Lock must be unlocked: the allocator may take it before
+// its constructor runs and never initialises it again, except in the
+// child after fork.
+//
+// Every policy also provides Stack<T>, the list the central lists are
+// made of. T links through _next. Stacks too must work zero-filled.
+//
+// With Counted set, Lock also has contention(), which the statistics
+// print for every lock that had to wait.
+
+// A list behind a lock of its own.
+template <class Lock, class T>
+class LockedStack {
+  Lock _lock;
+  T * _head;
+ public:
+  // Pushes the list first..last in one step
+  void pushList( T * first, T * last ) {
+    _lock.lock();
+    last->_next = _head;
+    _head = first;
+    _lock.unlock();
+  }
+  T * pop() {
+    _lock.lock();
+    T * t = _head;
+    if ( t ) {
+      _head = t->_next;
+    }
+    _lock.unlock();
+    return t;
+  }
+  T * popAll() {
+    _lock.lock();
+    T * t = _head;
+    _head = NULL;
+    _lock.unlock();
+    return t;
+  }
+
+  void prepareFork() { _lock.lock(); }
+  void parentAfterFork() { _lock.unlock(); }
+  void childAfterFork() { _lock.init(); }
+
+  const Lock & lock() const { return _lock; }
+};
+
+// Treiber stack. The head is a pointer and a generation count that
+// every push and pop increments, swapped together with a 16-byte CAS, so
+// a pop whose head was popped and pushed again in the meantime fails its
+// CAS instead of installing a stale next pointer. The count has 64 bits
+// because a pop may be preempted between reading the head and its CAS
+// for as long as the scheduler likes; a narrower one can come round to
+// the same value in that time. Popped objects must stay mapped, since a
+// losing pop may still read their link; the allocator's descriptors are
+// never unmapped.
+template <class T>
+class TaggedStack {
+#ifndef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+  static_assert( sizeof(T) == 0, "TaggedStack needs a 16-byte CAS; on "
+                 "x86-64 build with -mcx16" );
+#endif
+
+  union alignas(16) Head {
+    struct {
+      T * _top;
+      uint64_t _tag;
+    };
+    unsigned __int128 _both;
+  };
+
+  Head _head;
+
+  // The two halves are read apart, the count first. If the CAS that
+  // follows succeeds, the count did not move since, so neither did the
+  // pointer read after it.
+  Head read() const {
+    Head head;
+    head._tag = __atomic_load_n( &_head._tag, __ATOMIC_ACQUIRE );
+    head._top = __atomic_load_n( &_head._top, __ATOMIC_ACQUIRE );
+    return head;
+  }
+  bool replace( Head & head, T * top ) {
+    Head next;
+    next._top = top;
+    next._tag = head._tag + 1;
+    unsigned __int128 seen =
+      __sync_val_compare_and_swap( &_head._both, head._both, next._both );
+    if ( seen == head._both ) {
+      return true;
+    }
+    head._both = seen;
+    return false;
+  }
+
+ public:
+  void pushList( T * first, T * last ) {
+    Head head = read();
+    do {
+      __atomic_store_n( &last->_next, head._top, __ATOMIC_RELAXED );
+    } while ( !replace( head, first ) );
+  }
+  T * pop() {
+    Head head = read();
+    for ( ;; ) {
+      if ( head._top == NULL ) {
+        return NULL;
+      }
+      T * below = __atomic_load_n( &head._top->_next, __ATOMIC_RELAXED );
+      if ( replace( head, below ) ) {
+        return head._top;
+      }
+    }
+  }
+  T * popAll() {
+    Head head = read();
+    while ( head._top && !replace( head, NULL ) ) {
+    }
+    return head._top;
+  }
+
+  // A CAS is never half done, so fork needs nothing
+  void prepareFork() {}
+  void parentAfterFork() {}
+  void childAfterFork() {}
+};
+
+// Single-threaded programs only: every lock is a no-op and all objects
+// belong to one heap.
+class NoLocking {
+ public:
+  enum { ThreadSafe = 0, Counted = 0 };
+
+  class Lock {
+   public:
+    void init() {}
+    void lock() {}
+    void unlock() {}
+  };
+
+  template <class T>
+  using Stack = LockedStack<Lock, T>;
+};
+
+// Shared state is protected by pthread mutexes. On glibc
+// PTHREAD_MUTEX_INITIALIZER is all zeros.
+class MutexLocking {
+ public:
+  enum { ThreadSafe = 1, Counted = 0 };
+
+  class Lock {
+    pthread_mutex_t _mutex;
+   public:
+    void init() { pthread_mutex_init( &_mutex, NULL ); }
+    void lock() { pthread_mutex_lock( &_mutex ); }
+    void unlock() { pthread_mutex_unlock( &_mutex ); }
+  };
+
+  template <class T>
+  using Stack = LockedStack<Lock, T>;
+};
+
+// Threads never sleep in the allocator. Remote frees already use CAS and
+// the central lists are tagged Treiber stacks; the remaining short
+// critical sections spin on a test-and-test-and-set flag and yield the
+// CPU while it is taken.
+class LockFreeLocking {
+ public:
+  enum { ThreadSafe = 1, Counted = 0 };
+
+  class Lock {
+    std::atomic<int> _taken;
+   public:
+    void init() { _taken.store( 0, std::memory_order_relaxed ); }
+    void lock() {
+      while ( _taken.exchange( 1, std::memory_order_acquire ) ) {
+        while ( _taken.load( std::memory_order_relaxed ) ) {
+          sched_yield();
+        }
+      }
+    }
+    void unlock() { _taken.store( 0, std::memory_order_release ); }
+  };
+
+  template <class T>
+  using Stack = TaggedStack<T>;
+};
+
+// Waits on a taken lock first by spinning, backing off exponentially
+// with a pause between reads so the holder's critical section, usually
+// a few hundred nanoseconds, can end without a system call. After
+// SpinRounds reads, when the holder is probably not running, the waiter
+// parks on a futex. The state is 0 when free, 1 when taken and 2 when
+// taken with threads parked, so unlock makes a system call only when
+// someone sleeps. Counters are updated only by waiters.
+class FutexLocking {
+ public:
+  enum { ThreadSafe = 1, Counted = 1 };
+
+  class Contention {
+   public:
+    size_t _waits;            // Acquisitions that found the lock taken
+    size_t _spins;            // Pauses while spinning
+    size_t _parks;            // Futex waits
+    size_t _waitNs;           // Time from finding it taken to getting it
+  };
+
+  class Lock {
+    enum { SpinRounds = 8, MaxBackoff = 32 };
+
+    std::atomic<int> _state;
+    std::atomic<size_t> _waits;
+    std::atomic<size_t> _spins;
+    std::atomic<size_t> _parks;
+    std::atomic<size_t> _waitNs;
+
+    static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      __asm__ __volatile__( "yield" );
+#endif
+    }
+    static uint64_t nowNs() {
+      struct timespec ts;
+      clock_gettime( CLOCK_MONOTONIC, &ts );
+      return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    int * word() { return (int *) &_state; }
+
+    void lockSlow() {
+      uint64_t start = nowNs();
+      size_t spins = 0;
+      int backoff = 1;
+      for ( int round = 0; round < SpinRounds; round++ ) {
+        for ( int i = 0; i < backoff; i++ ) {
+          pause();
+        }
+        spins += backoff;
+        if ( backoff < MaxBackoff ) {
+          backoff *= 2;
+        }
+        int free = 0;
+        if ( _state.load( std::memory_order_relaxed ) == 0 &&
+             _state.compare_exchange_strong( free, 1,
+                                             std::memory_order_acquire ) ) {
+          count( start, spins, 0 );
+          return;
+        }
+      }
+
+      // Marking it 2 makes the holder wake someone. A thread that gets
+      // the lock this way leaves it at 2, which may cost one needless
+      // wake-up but never loses one.
+      size_t parks = 0;
+      while ( _state.exchange( 2, std::memory_order_acquire ) != 0 ) {
+        syscall( SYS_futex, word(), FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0 );
+        parks++;
+      }
+      count( start, spins, parks );
+    }
+
+    void count( uint64_t start, size_t spins, size_t parks ) {
+      _waits.fetch_add( 1, std::memory_order_relaxed );
+      _spins.fetch_add( spins, std::memory_order_relaxed );
+      _parks.fetch_add( parks, std::memory_order_relaxed );
+      _waitNs.fetch_add( nowNs() - start, std::memory_order_relaxed );
+    }
+
+   public:
+    void init() { _state.store( 0, std::memory_order_relaxed ); }
+    void lock() {
+      int free = 0;
+      if ( !_state.compare_exchange_strong( free, 1,
+                                            std::memory_order_acquire ) ) {
+        lockSlow();
+      }
+    }
+    void unlock() {
+      if ( _state.exchange( 0, std::memory_order_release ) == 2 ) {
+        syscall( SYS_futex, word(), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+      }
+    }
+
+    Contention contention() const {
+      Contention c;
+      c._waits = _waits.load( std::memory_order_relaxed );
+      c._spins = _spins.load( std::memory_order_relaxed );
+      c._parks = _parks.load( std::memory_order_relaxed );
+      c._waitNs = _waitNs.load( std::memory_order_relaxed );
+      return c;
+    }
+  };
+
+  template <class T>
+  using Stack = LockedStack<Lock, T>;
+};
+
+//
+// Statistics
+//
+
+enum {
+  MallocCall,
+  FreeCall,
+  ReallocCall,
+  CallocCall,
+  NumCallKinds
+};
+
+// No counters at all.
+class NoStats {
+ public:
+  enum { Enabled = 0 };
+
+  static void count( size_t * counters, int kind ) { (void) counters; (void) kind; }
+};
+
+// Every thread counts its own calls, so counting does not bounce a
+// shared cache line between cores. print() adds the threads up.
+class PerThreadStats {
+ public:
+  enum { Enabled = 1 };
+
+  static void count( size_t * counters, int kind ) { counters[ kind ]++; }
+};
+
+//
+// Checking
+//
+
+// Magic: headers of large objects carry a magic number that is checked
+// on free. Poison: freed memory is overwritten with a pattern. Validate:
+// free checks that the pointer is an object start and not already free.
+
+class NoChecks {
+ public:
+  enum { Magic = 0, Poison = 0, Validate = 0 };
+};
+
+class MagicChecks {
+ public:
+  enum { Magic = 1, Poison = 0, Validate = 0 };
+};
+
+class FullChecks {
+ public:
+  enum { Magic = 1, Poison = 1, Validate = 1 };
+};
+
+//
+// Placement in the free list of large objects
+//
+// The placement is chosen at startup with placement: in the
+// configuration string; the policy only sets the default.
+
+enum {
+  PlaceFirst,                 // First chunk that is large enough
+  PlaceNext,                  // First fit from where the last search stopped
+  PlaceBest,                  // Smallest chunk that is large enough
+  PlaceWorst,                 // Largest chunk
+  PlaceAddress,               // First fit in a list sorted by address
+  PlaceTlsf,                  // Two-level segregated fit, in constant time
+  NumPlacements
+};
+
+class FirstFit {
+ public:
+  enum { Default = PlaceFirst };
+};
+
+class NextFit {
+ public:
+  enum { Default = PlaceNext };
+};
+
+class BestFit {
+ public:
+  enum { Default = PlaceBest };
+};
+
+class WorstFit {
+ public:
+  enum { Default = PlaceWorst };
+};
+
+class AddressOrderedFit {
+ public:
+  enum { Default = PlaceAddress };
+};
+
+class TlsfFit {
+ public:
+  enum { Default = PlaceTlsf };
+};
+
+//
+// Page sources
+//
+
+// Grows the heap with sbrk. Consecutive calls usually return adjacent
+// memory, which lets the heap merge it with the previous segment.
+class SbrkPageSource {
+ public:
+  enum { Contiguous = 1 };
+
+  static void * allocate( size_t size ) {
+    void * mem = sbrk( size );
+    return mem == (void *) -1 ? NULL : mem;
+  }
+
+  // Gives back the last size bytes obtained, unless something else has
+  // moved the break since.
+  static bool release( void * start, size_t size ) {
+    if ( sbrk( 0 ) != (char *) start + size ) {
+      return false;
+    }
+    return sbrk( -(intptr_t) size ) != (void *) -1;
+  }
+};
+
+// Gets every segment from mmap. Works next to other code that uses brk.
+class MmapPageSource {
+ public:
+  enum { Contiguous = 0 };
+
+  static void * allocate( size_t size ) {
+    void * mem = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    return mem == MAP_FAILED ? NULL : mem;
+  }
+
+  // Unmaps the end of a segment; start is page aligned.
+  static bool release( void * start, size_t size ) {
+    return munmap( start, size ) == 0;
+  }
+};
+
+// Bundles one choice of each policy for AllocatorT.
+template <class LockingPolicy, class StatsPolicy, class CheckingPolicy,
+          class PlacementPolicy, class PageSourcePolicy>
+class Policies {
+ public:
+  typedef LockingPolicy Locking;
+  typedef StatsPolicy Stats;
+  typedef CheckingPolicy Checking;
+  typedef PlacementPolicy Placement;
+  typedef PageSourcePolicy PageSource;
+};
+
+#endif
@@ -0,0 +1,138 @@
+//
+// Size classes of small objects. Everything here is computed at compile
+// time: the class boundaries, how big a slab of each class is, how many
+// objects fit in it and how many objects move at a time between a slab
+// and the lists in front of it.
+//
+// Classes are 16 bytes apart up to 128 bytes and then four per power of
+// two, so no class wastes more than 20% of an object. Sizes up to
+// MaxDenseSize map to their class through a byte array indexed by
+// size / 16; larger sizes use the position of the highest bit.
+//
+
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  SmallGranularity = 16,
+  MaxSmallSize = 16 * 1024,
+  MaxDenseSize = 1024,
+
+  // Classes of 16, 32, ... 128 bytes, then four per power of two
+  LinearClasses = 8,
+  ClassesPerDoubling = 4,
+  NumSizeClasses = LinearClasses + ClassesPerDoubling * 7,
+
+  // Slabs are a multiple of MinSlabSize and hold at least
+  // MinObjectsPerSlab objects
+  MinSlabSize = 64 * 1024,
+  MaxSlabSize = 256 * 1024,
+  MinObjectsPerSlab = 8,
+
+  // Amount of memory moved per batch, bounded by Min/MaxBatch objects
+  BatchBytes = 32 * 1024,
+  MinBatch = 2,
+  MaxBatch = 64
+};
+
+class SizeClassInfo {
+ public:
+  uint32_t _size;               // Object size
+  uint32_t _slabSize;           // Bytes in a slab of this class
+  uint32_t _objectsPerSlab;
+  uint32_t _batchSize;          // Objects carved or moved at a time
+};
+
+// Object size of class c
+constexpr size_t
+sizeOfClass( int c )
+{
+  if ( c < LinearClasses ) {
+    return ( c + 1 ) * SmallGranularity;
+  }
+  int doubling = ( c - LinearClasses ) / ClassesPerDoubling;
+  int step = ( c - LinearClasses ) % ClassesPerDoubling;
+  size_t base = (size_t) ( LinearClasses * SmallGranularity ) << doubling;
+  return base + ( step + 1 ) * ( base / ClassesPerDoubling );
+}
+
+// Class of a size above MaxDenseSize: with size - 1 in [2^k, 2^(k+1)),
+// the doubling is k - 7 and the step is the two bits below the top one.
+// Defined for every size so that it can be evaluated unconditionally.
+constexpr int
+largeSizeToClass( size_t size )
+{
+  size_t x = ( size - 1 ) | 1;
+  int k = 63 - __builtin_clzll( x );
+  int doubling = k - 7;
+  int step = ( x >> ( k > 2 ? k - 2 : 0 ) ) & ( ClassesPerDoubling - 1 );
+  return LinearClasses + doubling * ClassesPerDoubling + step;
+}
+
+class SizeClassTable {
+ public:
+  SizeClassInfo _info[ NumSizeClasses ];
+  uint8_t _dense[ MaxDenseSize / SmallGranularity + 1 ];
+
+  constexpr SizeClassTable() : _info(), _dense() {
+    for ( int c = 0; c < NumSizeClasses; c++ ) {
+      size_t size = sizeOfClass( c );
+
+      // Smallest slab with enough objects that wastes at most 1/8
+      size_t slab = MinSlabSize;
+      while ( slab < MaxSlabSize &&
+              ( slab / size < MinObjectsPerSlab || slab % size > slab / 8 ) ) {
+        slab += MinSlabSize;
+      }
+
+      size_t batch = BatchBytes / size;
+      if ( batch < (size_t) MinBatch ) {
+        batch = MinBatch;
+      }
+      if ( batch > (size_t) MaxBatch ) {
+        batch = MaxBatch;
+      }
+
+      _info[ c ]._size = size;
+      _info[ c ]._slabSize = slab;
+      _info[ c ]._objectsPerSlab = slab / size;
+      _info[ c ]._batchSize = batch;
+    }
+
+    int c = 0;
+    for ( int i = 0; i <= MaxDenseSize / SmallGranularity; i++ ) {
+      while ( sizeOfClass( c ) < (size_t) i * SmallGranularity ) {
+        c++;
+      }
+      _dense[ i ] = c;
+    }
+  }
+};
+
+constexpr SizeClassTable TheSizeClasses;
+
+static_assert( sizeOfClass( NumSizeClasses - 1 ) == MaxSmallSize,
+               "last size class must be MaxSmallSize" );
+static_assert( largeSizeToClass( MaxDenseSize + 1 ) ==
+               TheSizeClasses._dense[ MaxDenseSize / SmallGranularity ] + 1,
+               "dense table and bit formula must meet" );
+static_assert( largeSizeToClass( MaxSmallSize ) == NumSizeClasses - 1,
+               "bit formula must reach the last class" );
+
+// Returns the class of a small size. The dense table is read for every
+// size, clamped, and the result picked with a conditional move, so the
+// lookup has no branches.
+static inline int
+sizeToClass( size_t size )
+{
+  size_t clamped = size < (size_t) MaxDenseSize ? size : (size_t) MaxDenseSize;
+  int dense = TheSizeClasses._dense[ ( clamped + SmallGranularity - 1 ) /
+                                     SmallGranularity ];
+  int large = largeSizeToClass( size );
+  return size <= MaxDenseSize ? dense : large;
+}
+
+#endif
@@ -1,4 +1,7 @@
-#include "minicrt.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
 // Don't include stdlb since the names will conflict?
 
 // TODO: align
@@ -6,26 +9,6 @@
 // sbrk some extra space every time we need it.
 // This does no bookkeeping and therefore has no ability to free, realloc, etc.
 
-static int brk(void* end_data_segment)
-{
-	int ret	= 0;
-	//brk system call number:45
-	//int //usr/include/asm-i386/unistd.h
-	//#define __NR_brk 45
-	asm( "movl $45, %%eax   \n\t"
-		 "movl %1, %%ebx  \n\t"
-		 "int $0x80		\n\t"
-		 "movl %%eax,%0  \n\t"
-		 : "=r"(ret):"m"(end_data_segment));
-}
-
-void * sbrk(int size){
-    void * p = brk(0);
-    brk(((char*)p)+size);
-    return p;
-    ;
-}
-
 void *nofree_malloc(int size) {
   void *p = sbrk(0);
   void *request = sbrk(size);
@@ -41,12 +24,17 @@ struct block_meta {
   int size;
   struct block_meta *next;
   int free;
-  int magic;    // For debugging only. TODO: remove this in non-debug mode.
+#ifdef DEBUG
+  int magic;    // For debugging only.
+#endif
 };
 
 #define META_SIZE sizeof(struct block_meta)
 
-void *global_base = NULL;
+// The list starts with a block that is never free, so the first call
+// takes the same path as every other one.
+static struct block_meta base_block;
+void *global_base = &base_block;
 
 // Iterate through blocks until we find one that's large enough.
 // TODO: split block up if it's larger than necessary
@@ -74,40 +62,36 @@ struct block_meta *request_space(struct block_meta* last, int size) {
   block->size = size;
   block->next = NULL;
   block->free = 0;
+#ifdef DEBUG
   block->magic = 0x12345678;
+#endif
   return block;
 }
 
-// If it's the first ever call, i.e., global_base == NULL, request_space and set global_base.
-// Otherwise, if we can find a free block, use it.
-// If not, request_space.
-void *malloc(int size) {
+// If we can find a free block, use it.
+// If not, request_space. global_base is never NULL, see base_block.
+// Block sizes are ints, so larger requests fail.
+void *malloc(size_t size) {
   struct block_meta *block;
   // TODO: align size?
 
-  if (size <= 0) {
+  if (size == 0 || size > INT_MAX) {
     return NULL;
   }
 
-  if (!global_base) { // First call.
-    block = request_space(NULL, size);
+  struct block_meta *last = global_base;
+  block = find_free_block(&last, size);
+  if (!block) { // Failed to find free block.
+    block = request_space(last, size);
     if (!block) {
       return NULL;
     }
-    global_base = block;
-  } else {
-    struct block_meta *last = global_base;
-    block = find_free_block(&last, size);
-    if (!block) { // Failed to find free block.
-      block = request_space(last, size);
-      if (!block) {
-	return NULL;
-      }
-    } else {      // Found free block
-      // TODO: consider splitting block here.
-      block->free = 0;
-      block->magic = 0x77777777;
-    }
+  } else {      // Found free block
+    // TODO: consider splitting block here.
+    block->free = 0;
+#ifdef DEBUG
+    block->magic = 0x77777777;
+#endif
   }
   
   return(block+1);
@@ -120,6 +104,36 @@ struct block_meta *get_block_ptr(void *ptr) {
   return (struct block_meta*)ptr - 1;
 }
 
+// Gives the last block back to the system if it is free and at the top
+// of the break, keeping pad bytes of it. Returns 1 if memory was released.
+int malloc_trim(size_t pad) {
+  struct block_meta *last = global_base;
+  struct block_meta *prev = NULL;
+  while (last->next) {
+    prev = last;
+    last = last->next;
+  }
+
+  if (!last->free || (size_t)last->size <= pad) {
+    return 0;
+  }
+  char *end = (char *)(last + 1) + last->size;
+  if (sbrk(0) != end) { // Someone else moved the break
+    return 0;
+  }
+
+  if (pad > 0) {
+    sbrk(-(intptr_t)(last->size - pad));
+    last->size = (int)pad;
+  } else {
+    sbrk(-(int)(last->size + META_SIZE));
+    prev->next = NULL;
+  }
+  return 1;
+}
+
+#define TRIM_THRESHOLD (128 * 1024)
+
 void free(void *ptr) {
   if (!ptr) {
     return;
@@ -129,7 +143,14 @@ void free(void *ptr) {
   struct block_meta* block_ptr = get_block_ptr(ptr);
 
   block_ptr->free = 1;
-  block_ptr->magic = 0x55555555;  
+#ifdef DEBUG
+  block_ptr->magic = 0x55555555;
+#endif
+
+  // A large block at the top of the heap goes back right away
+  if (block_ptr->next == NULL && block_ptr->size >= TRIM_THRESHOLD) {
+    malloc_trim(0);
+  }
 }
 
 
@@ -0,0 +1,71 @@
+// Helpers shared by the multi-threaded allocator benchmarks.
+// Every benchmark prints a single line in the same format so that runs
+// against different allocators can be compared with diff or a spreadsheet.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+static inline uint64_t bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline long bench_rss_kb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static inline long bench_peak_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+// xorshift64*; each thread keeps its own state so the generator is not
+// a point of contention.
+static inline uint64_t bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ull;
+}
+
+static inline int bench_threads(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1;
+  if (n < 1 || n > MAX_THREADS) {
+    fprintf(stderr, "thread count must be between 1 and %d\n", MAX_THREADS);
+    exit(1);
+  }
+  return n;
+}
+
+static inline void bench_report(const char *name, int threads, uint64_t ops,
+                                uint64_t elapsed_ns) {
+  printf("%-14s threads %3d  %12.0f ops/s  %8.3f s  rss %8ld KB  peak %8ld KB\n",
+         name, threads, ops / (elapsed_ns / 1e9), elapsed_ns / 1e9,
+         bench_rss_kb(), bench_peak_rss_kb());
+  fflush(stdout);
+}
+
+#endif
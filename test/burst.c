@@ -0,0 +1,55 @@
+// Burst benchmark. Every thread allocates a large number of objects of
+// one size before freeing any of them, then frees every other one and
+// allocates them again. An allocator that rescans full slabs, pages or
+// bitmap words for free space slows down as the burst grows; run it with
+// increasing object counts to see whether the time per operation stays
+// flat.
+//
+// Usage: ./burst threads [objects-per-thread] [size]
+
+#include "bench.h"
+
+static int nobjects;
+static size_t size;
+
+static void *burst_thread(void *arg) {
+  (void)arg;
+  void **objects = malloc(nobjects * sizeof(void *));
+
+  for (int i = 0; i < nobjects; i++) {
+    char *p = malloc(size);
+    p[0] = (char)i;
+    objects[i] = p;
+  }
+  for (int i = 0; i < nobjects; i += 2) {
+    free(objects[i]);
+  }
+  for (int i = 0; i < nobjects; i += 2) {
+    objects[i] = malloc(size);
+  }
+  for (int i = 0; i < nobjects; i++) {
+    free(objects[i]);
+  }
+
+  free(objects);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  nobjects = argc > 2 ? atoi(argv[2]) : 2000000;
+  size = argc > 3 ? (size_t)atoi(argv[3]) : 16;
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, burst_thread, (void *)(uintptr_t)t);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("burst", nthreads, 3ull * nobjects * nthreads, elapsed);
+  return 0;
+}
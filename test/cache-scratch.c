@@ -0,0 +1,55 @@
+// Hoard's cache-scratch: passive false sharing. The main thread
+// allocates one small object per worker, back to back, and hands each
+// worker its object. The worker frees it and then repeatedly allocates,
+// writes and frees objects of the same size. An allocator that reuses
+// the freed object for the worker keeps every worker on the cache line
+// the main thread carved the objects from.
+//
+// Usage: ./cache-scratch threads [iterations] [repetitions] [size]
+
+#include "bench.h"
+
+static int iterations;
+static int repetitions;
+static int object_size;
+
+static void *scratch_thread(void *arg) {
+  free(arg);
+  for (int i = 0; i < iterations; i++) {
+    volatile char *p = malloc(object_size);
+    for (int r = 0; r < repetitions; r++) {
+      for (int j = 0; j < object_size; j++) {
+        p[j]++;
+      }
+    }
+    free((void *)p);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  iterations = argc > 2 ? atoi(argv[2]) : 1000;
+  repetitions = argc > 3 ? atoi(argv[3]) : 10000;
+  object_size = argc > 4 ? atoi(argv[4]) : 8;
+
+  void *initial[MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    initial[t] = malloc(object_size);
+  }
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, scratch_thread, initial[t]);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("cache-scratch", nthreads,
+               (uint64_t)nthreads * iterations * repetitions * object_size,
+               elapsed);
+  return 0;
+}
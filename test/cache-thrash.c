@@ -0,0 +1,50 @@
+// Hoard's cache-thrash: active false sharing. Every thread repeatedly
+// allocates a small object, writes it many times and frees it. If the
+// allocator hands objects from the same cache line to different threads
+// the writes ping-pong that line between cores.
+//
+// Usage: ./cache-thrash threads [iterations] [repetitions] [size]
+
+#include "bench.h"
+
+static int iterations;
+static int repetitions;
+static int object_size;
+
+static void *thrash_thread(void *arg) {
+  (void)arg;
+  for (int i = 0; i < iterations; i++) {
+    volatile char *p = malloc(object_size);
+    for (int r = 0; r < repetitions; r++) {
+      for (int j = 0; j < object_size; j++) {
+        p[j]++;
+      }
+    }
+    free((void *)p);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  iterations = argc > 2 ? atoi(argv[2]) : 1000;
+  repetitions = argc > 3 ? atoi(argv[3]) : 10000;
+  object_size = argc > 4 ? atoi(argv[4]) : 8;
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, thrash_thread, NULL);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  // An "op" is one write to the object; the figure is meant to be
+  // compared across thread counts, where it should grow linearly.
+  bench_report("cache-thrash", nthreads,
+               (uint64_t)nthreads * iterations * repetitions * object_size,
+               elapsed);
+  return 0;
+}
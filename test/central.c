@@ -0,0 +1,57 @@
+// Central list contention benchmark. Every thread repeatedly allocates
+// enough objects of one size to fill several slabs and then frees them
+// all, so each round gives its empty slabs back to the shared central
+// list of the class and takes slabs from it again. All threads use the
+// same size class, which makes the central list the point of contention.
+// Compare a build whose central lists take a lock with the lock-free one:
+//
+//   LD_PRELOAD=./mymalloc.so ./central 8
+//   LD_PRELOAD=./mymalloc-lockfree.so ./central 8
+//
+// Usage: ./central threads [rounds] [objects-per-round] [size]
+
+#include "bench.h"
+
+static int rounds;
+static int nobjects;
+static size_t size;
+
+static void *central_thread(void *arg) {
+  (void)arg;
+  void **objects = malloc(nobjects * sizeof(void *));
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < nobjects; i++) {
+      char *p = malloc(size);
+      p[0] = (char)i;
+      objects[i] = p;
+    }
+    for (int i = 0; i < nobjects; i++) {
+      free(objects[i]);
+    }
+  }
+
+  free(objects);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  rounds = argc > 2 ? atoi(argv[2]) : 20000;
+  nobjects = argc > 3 ? atoi(argv[3]) : 64;
+  size = argc > 4 ? (size_t)atoi(argv[4]) : 16384;
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, central_thread, (void *)(uintptr_t)t);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("central", nthreads, 2ull * rounds * nobjects * nthreads,
+               elapsed);
+  return 0;
+}
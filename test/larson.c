@@ -0,0 +1,98 @@
+// Larson & Krishnan server benchmark. Every thread owns an array of
+// blocks and repeatedly replaces a random block with a new one of random
+// size. After a fixed number of replacements a thread hands its array to
+// a freshly created successor and exits, so blocks are freed by a thread
+// other than the one that allocated them, as in a server whose worker
+// threads come and go.
+//
+// Usage: ./larson threads [seconds] [min-size] [max-size] [blocks-per-thread]
+
+#include "bench.h"
+
+#define ROUND_OPS 10000
+
+struct worker {
+  void **blocks;
+  int nblocks;
+  int min_size;
+  int max_size;
+  uint64_t seed;
+  uint64_t ops;
+  uint64_t deadline;
+};
+
+static struct worker workers[MAX_THREADS];
+
+static size_t random_size(struct worker *w) {
+  return w->min_size + bench_rand(&w->seed) % (w->max_size - w->min_size + 1);
+}
+
+static void *larson_thread(void *arg) {
+  struct worker *w = arg;
+
+  for (int i = 0; i < ROUND_OPS; i++) {
+    int victim = bench_rand(&w->seed) % w->nblocks;
+    free(w->blocks[victim]);
+    char *p = malloc(random_size(w));
+    p[0] = (char)i;
+    w->blocks[victim] = p;
+  }
+  w->ops += 2 * ROUND_OPS;
+
+  // Hand the blocks over to a successor thread, as a server would when
+  // a connection moves to another worker.
+  if (bench_now_ns() < w->deadline) {
+    pthread_t next;
+    pthread_create(&next, NULL, larson_thread, w);
+    pthread_detach(next);
+  } else {
+    __atomic_store_n(&w->deadline, 0, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  int seconds = argc > 2 ? atoi(argv[2]) : 2;
+  int min_size = argc > 3 ? atoi(argv[3]) : 8;
+  int max_size = argc > 4 ? atoi(argv[4]) : 1000;
+  int nblocks = argc > 5 ? atoi(argv[5]) : 1000;
+
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    struct worker *w = &workers[t];
+    w->nblocks = nblocks;
+    w->min_size = min_size;
+    w->max_size = max_size;
+    w->seed = 0x9e3779b97f4a7c15ull * (t + 1);
+    w->deadline = start + (uint64_t)seconds * 1000000000ull;
+    w->blocks = malloc(nblocks * sizeof(void *));
+    for (int i = 0; i < nblocks; i++) {
+      w->blocks[i] = malloc(random_size(w));
+    }
+  }
+
+  start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, larson_thread, &workers[t]);
+    pthread_detach(thread);
+  }
+
+  uint64_t ops = 0;
+  for (int t = 0; t < nthreads; t++) {
+    while (__atomic_load_n(&workers[t].deadline, __ATOMIC_ACQUIRE) != 0) {
+      usleep(1000);
+    }
+    ops += workers[t].ops;
+  }
+  bench_report("larson", nthreads, ops, bench_now_ns() - start);
+
+  for (int t = 0; t < nthreads; t++) {
+    for (int i = 0; i < nblocks; i++) {
+      free(workers[t].blocks[i]);
+    }
+    free(workers[t].blocks);
+  }
+  return 0;
+}
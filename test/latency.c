@@ -0,0 +1,148 @@
+// Latency benchmark. Every thread keeps a set of live objects and, at
+// each step, frees a random one or allocates it again with a size drawn
+// log-uniformly between 16 bytes and max-size, timing every malloc and
+// free on its own. Reports the usual throughput line and then the
+// median, p99, p99.99 and maximum latency of each call, since an
+// allocator with a bounded worst case is judged by the tail and not the
+// average. Small and large sizes are reported apart, because allocators
+// usually serve them on different paths with different worst cases.
+//
+// Usage: ./latency threads [operations-per-thread] [max-size] [live]
+
+#include "bench.h"
+
+static int nops;
+static size_t max_size;
+static int nlive;
+
+// Sizes up to this are small: MyMalloc's largest slab size class
+#define SMALL_MAX 16384
+
+enum { SMALL, LARGE, KINDS };
+
+struct samples {
+  uint32_t *malloc_ns[KINDS];
+  uint32_t *free_ns[KINDS];
+  size_t mallocs[KINDS];
+  size_t frees[KINDS];
+};
+
+static struct samples results[MAX_THREADS];
+
+static uint32_t elapsed_since(uint64_t start) {
+  uint64_t ns = bench_now_ns() - start;
+  return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static void *latency_thread(void *arg) {
+  struct samples *s = &results[(uintptr_t)arg];
+  uint64_t rng = 0x9e3779b97f4a7c15ull * ((uintptr_t)arg + 1);
+  void **live = calloc(nlive, sizeof(void *));
+  size_t *live_size = calloc(nlive, sizeof(size_t));
+  int max_log = 63 - __builtin_clzll(max_size);
+
+  for (int i = 0; i < nops; i++) {
+    uint64_t r = bench_rand(&rng);
+    int slot = r % nlive;
+    if (live[slot]) {
+      int kind = live_size[slot] <= SMALL_MAX ? SMALL : LARGE;
+      uint64_t start = bench_now_ns();
+      free(live[slot]);
+      s->free_ns[kind][s->frees[kind]++] = elapsed_since(start);
+      live[slot] = NULL;
+    }
+    else {
+      int log = 4 + (r >> 32) % (max_log - 3);
+      size_t size = ((size_t)1 << log) + (r >> 16) % ((size_t)1 << log);
+      if (size > max_size) {
+        size = max_size;
+      }
+      int kind = size <= SMALL_MAX ? SMALL : LARGE;
+      uint64_t start = bench_now_ns();
+      char *p = malloc(size);
+      s->malloc_ns[kind][s->mallocs[kind]++] = elapsed_since(start);
+      p[0] = (char)i;
+      live[slot] = p;
+      live_size[slot] = size;
+    }
+  }
+
+  for (int i = 0; i < nlive; i++) {
+    free(live[i]);
+  }
+  free(live);
+  free(live_size);
+  return NULL;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Merges the samples of every thread, sorts them and prints percentiles
+static void report_latency(const char *call, int nthreads, int kind,
+                           int is_free) {
+  size_t count = 0;
+  for (int t = 0; t < nthreads; t++) {
+    count += is_free ? results[t].frees[kind] : results[t].mallocs[kind];
+  }
+  if (count == 0) {
+    return;
+  }
+  uint32_t *all = malloc(count * sizeof(uint32_t));
+  size_t n = 0;
+  for (int t = 0; t < nthreads; t++) {
+    size_t k = is_free ? results[t].frees[kind] : results[t].mallocs[kind];
+    memcpy(all + n,
+           is_free ? results[t].free_ns[kind] : results[t].malloc_ns[kind],
+           k * sizeof(uint32_t));
+    n += k;
+  }
+  qsort(all, count, sizeof(uint32_t), compare_ns);
+  printf("  %-12s ns  p50 %u  p99 %u  p99.99 %u  max %u\n", call,
+         all[count / 2], all[count * 99 / 100], all[count * 9999 / 10000],
+         all[count - 1]);
+  free(all);
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  nops = argc > 2 ? atoi(argv[2]) : 1000000;
+  max_size = argc > 3 ? (size_t)atol(argv[3]) : 128 * 1024;
+  nlive = argc > 4 ? atoi(argv[4]) : 1000;
+  if (max_size < 32) {
+    max_size = 32;
+  }
+  if (nlive < 1) {
+    nlive = 1;
+  }
+
+  // Allocated up front so that recording a sample never calls malloc
+  for (int t = 0; t < nthreads; t++) {
+    for (int k = 0; k < KINDS; k++) {
+      results[t].malloc_ns[k] = malloc(nops * sizeof(uint32_t));
+      results[t].free_ns[k] = malloc(nops * sizeof(uint32_t));
+      memset(results[t].malloc_ns[k], 0, nops * sizeof(uint32_t));
+      memset(results[t].free_ns[k], 0, nops * sizeof(uint32_t));
+    }
+  }
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, latency_thread, (void *)(uintptr_t)t);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("latency", nthreads, (uint64_t)nops * nthreads, elapsed);
+  report_latency("small malloc", nthreads, SMALL, 0);
+  report_latency("small free", nthreads, SMALL, 1);
+  report_latency("large malloc", nthreads, LARGE, 0);
+  report_latency("large free", nthreads, LARGE, 1);
+  return 0;
+}
@@ -0,0 +1,411 @@
+// Replays an allocation trace against whatever malloc is linked or
+// LD_PRELOADed (malloc.so, mymalloc.so or plain glibc).
+//
+// Trace format, one operation per line ('#' starts a comment):
+//
+//   <thread> m <id> <size>            malloc
+//   <thread> c <id> <size>            calloc(1, size)
+//   <thread> r <old-id> <new-id> <size>  realloc; old-id may be -1 for NULL
+//   <thread> f <id>                   free
+//
+// <thread> is a small integer; every thread of the trace is replayed by
+// its own pthread in trace order. <id> names an allocation; ids may be
+// reused after they are freed and may be freed by another thread than
+// the one that allocated them. Cross-thread uses of an id wait until the
+// operation that precedes them in the trace has happened.
+//
+// The whole trace is decoded into flat per-thread arrays before the clock
+// starts, so parsing does not show up in the numbers.
+//
+// Usage: LD_PRELOAD=./malloc.so ./replay trace [repetitions]
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE };
+
+// One decoded trace operation. The wait fields hold the value the id's
+// sequence counter must have before the operation may run; the counter
+// is bumped once by the allocation and once by the free of each id.
+struct op {
+  uint32_t kind;
+  uint32_t id;          // id written (malloc, calloc, realloc new id)
+  uint32_t old_id;      // id read (free, realloc old id), or NONE
+  uint32_t wait;        // required seq of id before the op
+  uint32_t old_wait;    // required seq of old_id before the op
+  size_t size;
+};
+
+#define NONE UINT32_MAX
+
+struct slot {
+  void *ptr;
+  size_t size;
+  uint32_t seq;
+};
+
+struct thread_trace {
+  struct op *ops;
+  size_t count;
+  size_t capacity;
+  uint64_t *latency;    // nanoseconds per op
+  pthread_t handle;
+};
+
+static struct thread_trace threads[MAX_THREADS];
+static int nthreads;
+static struct slot *slots;
+static uint32_t nslots;
+static int64_t live_bytes;
+static int64_t peak_live_bytes;
+static volatile int start_flag;
+
+// The driver's own bookkeeping is mmapped so that it never goes through
+// the allocator being measured.
+static void *xmap(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return p;
+}
+
+static void *xremap(void *old, size_t old_size, size_t new_size) {
+  void *p = xmap(new_size);
+  if (old) {
+    memcpy(p, old, old_size);
+    munmap(old, old_size);
+  }
+  return p;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long rss_kb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long peak_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void push_op(int tid, struct op *o) {
+  struct thread_trace *t = &threads[tid];
+  if (t->count == t->capacity) {
+    size_t ncap = t->capacity ? t->capacity * 2 : 4096;
+    t->ops = xremap(t->ops, t->capacity * sizeof(struct op),
+                    ncap * sizeof(struct op));
+    t->capacity = ncap;
+  }
+  t->ops[t->count++] = *o;
+  if (tid >= nthreads) {
+    nthreads = tid + 1;
+  }
+}
+
+// Decoding runs in two passes over the file: the first finds the largest
+// id so the sequence table can be sized, the second fills the op arrays.
+static void decode(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  char line[256];
+  long max_id = -1;
+  while (fgets(line, sizeof(line), f)) {
+    int tid;
+    char kind;
+    long a = -1, b = -1;
+    if (sscanf(line, "%d %c %ld %ld", &tid, &kind, &a, &b) < 3) {
+      continue;
+    }
+    if (a > max_id) max_id = a;
+    if (kind == 'r' && b > max_id) max_id = b;
+  }
+  if (max_id < 0) {
+    fprintf(stderr, "%s: empty trace\n", path);
+    exit(1);
+  }
+
+  nslots = (uint32_t)max_id + 1;
+  slots = xmap(nslots * sizeof(struct slot));
+  uint32_t *seq = xmap(nslots * sizeof(uint32_t));
+
+  rewind(f);
+  long lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    int tid;
+    char kind;
+    long a = -1, b = -1, c = 0;
+    lineno++;
+    if (line[0] == '#' || sscanf(line, "%d %c", &tid, &kind) < 2) {
+      continue;
+    }
+    if (tid < 0 || tid >= MAX_THREADS) {
+      fprintf(stderr, "%s:%ld: thread %d out of range\n", path, lineno, tid);
+      exit(1);
+    }
+
+    struct op o = { 0, NONE, NONE, 0, 0, 0 };
+    int n = sscanf(line, "%*d %*c %ld %ld %ld", &a, &b, &c);
+    switch (kind) {
+    case 'm':
+    case 'c':
+      if (n < 2) goto bad;
+      o.kind = kind == 'm' ? OP_MALLOC : OP_CALLOC;
+      o.id = a;
+      o.size = b;
+      break;
+    case 'r':
+      if (n < 3) goto bad;
+      o.kind = OP_REALLOC;
+      o.old_id = a < 0 ? NONE : (uint32_t)a;
+      o.id = b;
+      o.size = c;
+      break;
+    case 'f':
+      if (n < 1) goto bad;
+      o.kind = OP_FREE;
+      o.old_id = a;
+      break;
+    default:
+      goto bad;
+    }
+
+    // Ids alternate allocated (odd seq) and free (even seq).
+    if (o.old_id != NONE) {
+      if ((seq[o.old_id] & 1) == 0) {
+        fprintf(stderr, "%s:%ld: id %u is not allocated\n", path, lineno,
+                o.old_id);
+        exit(1);
+      }
+      o.old_wait = seq[o.old_id]++;
+    }
+    if (o.id != NONE) {
+      if (seq[o.id] & 1) {
+        fprintf(stderr, "%s:%ld: id %u is still allocated\n", path, lineno,
+                o.id);
+        exit(1);
+      }
+      o.wait = seq[o.id]++;
+    }
+    push_op(tid, &o);
+    continue;
+
+  bad:
+    fprintf(stderr, "%s:%ld: malformed line\n", path, lineno);
+    exit(1);
+  }
+  fclose(f);
+  munmap(seq, nslots * sizeof(uint32_t));
+}
+
+static void wait_seq(uint32_t id, uint32_t value) {
+  while (__atomic_load_n(&slots[id].seq, __ATOMIC_ACQUIRE) != value) {
+    sched_yield();
+  }
+}
+
+static void account(int64_t delta) {
+  int64_t live = __atomic_add_fetch(&live_bytes, delta, __ATOMIC_RELAXED);
+  int64_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void *replay_thread(void *arg) {
+  struct thread_trace *t = arg;
+
+  while (!start_flag) {
+    sched_yield();
+  }
+
+  for (size_t i = 0; i < t->count; i++) {
+    struct op *o = &t->ops[i];
+    void *old = NULL;
+    size_t old_size = 0;
+
+    if (o->old_id != NONE) {
+      wait_seq(o->old_id, o->old_wait);
+      old = slots[o->old_id].ptr;
+      old_size = slots[o->old_id].size;
+    }
+    if (o->id != NONE && o->id != o->old_id) {
+      wait_seq(o->id, o->wait);
+    }
+
+    uint64_t start = now_ns();
+    void *p = NULL;
+    switch (o->kind) {
+    case OP_MALLOC:
+      p = malloc(o->size);
+      break;
+    case OP_CALLOC:
+      p = calloc(1, o->size);
+      break;
+    case OP_REALLOC:
+      p = realloc(old, o->size);
+      break;
+    case OP_FREE:
+      free(old);
+      break;
+    }
+    t->latency[i] = now_ns() - start;
+
+    if (o->kind != OP_FREE) {
+      if (p == NULL && o->size != 0) {
+        fprintf(stderr, "allocation of %zu bytes failed\n", o->size);
+        exit(1);
+      }
+      // Touch the block so its pages count towards RSS like they would
+      // for a real program.
+      if (p && o->kind == OP_MALLOC) {
+        memset(p, 0xa5, o->size < 64 ? o->size : 64);
+      }
+    }
+
+    account((int64_t)o->size - (int64_t)old_size);
+    if (o->old_id != NONE) {
+      slots[o->old_id].ptr = NULL;
+      slots[o->old_id].size = 0;
+      __atomic_store_n(&slots[o->old_id].seq, o->old_wait + 1,
+                       __ATOMIC_RELEASE);
+    }
+    if (o->id != NONE) {
+      slots[o->id].ptr = p;
+      slots[o->id].size = o->size;
+      __atomic_store_n(&slots[o->id].seq, o->wait + 1, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *sorted, size_t n, double p) {
+  size_t i = (size_t)(p / 100.0 * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+// Frees whatever the trace left allocated so that repeated runs start
+// from the same state.
+static void release_leftovers() {
+  for (uint32_t i = 0; i < nslots; i++) {
+    if (slots[i].ptr) {
+      free(slots[i].ptr);
+      account(-(int64_t)slots[i].size);
+    }
+    slots[i].ptr = NULL;
+    slots[i].size = 0;
+    slots[i].seq = 0;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s trace [repetitions]\n", argv[0]);
+    printf("Replays an allocation trace; use LD_PRELOAD to pick the allocator.\n");
+    return 1;
+  }
+  int reps = argc > 2 ? atoi(argv[2]) : 1;
+  if (reps < 1) {
+    reps = 1;
+  }
+
+  decode(argv[1]);
+
+  size_t total_ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    total_ops += threads[i].count;
+    threads[i].latency = xmap((threads[i].count + 1) * sizeof(uint64_t));
+  }
+  uint64_t *all = xmap((total_ops * reps + 1) * sizeof(uint64_t));
+  size_t nall = 0;
+
+  // Fault in everything the driver writes during the replay, so that
+  // its own pages are part of the baseline and not of the peak
+  for (int i = 0; i < nthreads; i++) {
+    memset(threads[i].latency, 0, (threads[i].count + 1) * sizeof(uint64_t));
+  }
+  memset(all, 0, (total_ops * reps + 1) * sizeof(uint64_t));
+  memset(slots, 0, nslots * sizeof(struct slot));
+
+  long base_rss = rss_kb();
+  uint64_t elapsed = 0;
+
+  for (int r = 0; r < reps; r++) {
+    start_flag = 0;
+    for (int i = 0; i < nthreads; i++) {
+      pthread_create(&threads[i].handle, NULL, replay_thread, &threads[i]);
+    }
+    uint64_t start = now_ns();
+    start_flag = 1;
+    for (int i = 0; i < nthreads; i++) {
+      pthread_join(threads[i].handle, NULL);
+    }
+    elapsed += now_ns() - start;
+
+    for (int i = 0; i < nthreads; i++) {
+      memcpy(all + nall, threads[i].latency, threads[i].count * sizeof(uint64_t));
+      nall += threads[i].count;
+    }
+    release_leftovers();
+  }
+
+  qsort(all, nall, sizeof(uint64_t), compare_u64);
+
+  long peak_kb = peak_rss_kb() - base_rss;
+  double peak_live_kb = peak_live_bytes / 1024.0;
+
+  printf("trace:          %s\n", argv[1]);
+  printf("threads:        %d\n", nthreads);
+  printf("ops:            %zu x %d\n", total_ops, reps);
+  printf("time:           %.3f s\n", elapsed / 1e9);
+  printf("throughput:     %.0f ops/s\n", nall / (elapsed / 1e9));
+  printf("latency (ns):   p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+         (unsigned long long)percentile(all, nall, 50),
+         (unsigned long long)percentile(all, nall, 90),
+         (unsigned long long)percentile(all, nall, 99),
+         (unsigned long long)percentile(all, nall, 99.9),
+         (unsigned long long)all[nall - 1]);
+  printf("peak live:      %.0f KB\n", peak_live_kb);
+  printf("peak RSS:       %ld KB (above %ld KB at start)\n", peak_kb, base_rss);
+  if (peak_live_kb > 0) {
+    printf("fragmentation:  %.3f (peak RSS / peak live)\n", peak_kb / peak_live_kb);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+// SmartHeap-style size-mix benchmark. Every thread allocates batches of
+// objects whose sizes are drawn from a skewed mix (mostly small, some
+// medium, a few large) and frees them in an interleaved order, so the
+// allocator sees many size classes live at once and frees that do not
+// mirror the allocation order.
+//
+// Usage: ./shbench threads [iterations] [batch]
+
+#include "bench.h"
+
+static int iterations;
+static int batch;
+
+// Roughly the distribution shbench uses: most requests are tiny.
+static size_t mixed_size(uint64_t *seed) {
+  uint64_t r = bench_rand(seed);
+  unsigned pick = r % 100;
+  r >>= 8;
+  if (pick < 70) {
+    return 1 + r % 64;
+  } else if (pick < 90) {
+    return 64 + r % 448;
+  } else if (pick < 99) {
+    return 512 + r % 3584;
+  }
+  return 4096 + r % 61440;
+}
+
+static void *shbench_thread(void *arg) {
+  uint64_t seed = (uintptr_t)arg * 0x9e3779b97f4a7c15ull + 1;
+  void **objects = malloc(batch * sizeof(void *));
+
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < batch; j++) {
+      size_t size = mixed_size(&seed);
+      char *p = malloc(size);
+      p[0] = p[size - 1] = (char)j;
+      objects[j] = p;
+    }
+    // Free every other object first, then the rest, in reverse.
+    for (int j = 0; j < batch; j += 2) {
+      free(objects[j]);
+    }
+    for (int j = batch - 1 - (batch % 2 == 0 ? 0 : 1); j > 0; j -= 2) {
+      free(objects[j]);
+    }
+  }
+
+  free(objects);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  iterations = argc > 2 ? atoi(argv[2]) : 200;
+  batch = argc > 3 ? atoi(argv[3]) : 5000;
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, shbench_thread, (void *)(uintptr_t)t);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("shbench", nthreads, 2ull * iterations * batch * nthreads,
+               elapsed);
+  return 0;
+}
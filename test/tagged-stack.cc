@@ -0,0 +1,115 @@
+// Stress test of TaggedStack, the central list of the lock-free build,
+// on its own so that it can run under ThreadSanitizer and
+// AddressSanitizer, which cannot wrap a preloaded malloc. A few nodes go
+// round many threads as fast as possible, which is where a pop that
+// installs a stale next pointer shows up: a node is then popped by two
+// threads at once, or lost.
+//
+// Usage: ./tagged-stack [threads] [rounds-per-thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "../MyMallocPolicies.h"
+
+struct Node {
+  Node * _next;
+  std::atomic<int> _held;
+};
+
+enum { Nodes = 8 };
+
+static Node nodes[ Nodes ];
+static TaggedStack<Node> stack;
+static int rounds;
+static std::atomic<int> errors;
+
+static void take( Node * n ) {
+  if ( n->_held.exchange( 1, std::memory_order_relaxed ) ) {
+    errors++;
+  }
+}
+
+static void give( Node * n ) {
+  n->_held.store( 0, std::memory_order_relaxed );
+}
+
+static void * churn( void * arg ) {
+  unsigned seed = (unsigned) (size_t) arg;
+  for ( int i = 0; i < rounds; i++ ) {
+    unsigned r = rand_r( &seed );
+    if ( r % 16 == 0 ) {
+      // Take everything and give it back as one list
+      Node * first = stack.popAll();
+      Node * last = NULL;
+      for ( Node * n = first; n; n = n->_next ) {
+        take( n );
+        last = n;
+      }
+      for ( Node * n = first; n; n = n->_next ) {
+        give( n );
+      }
+      if ( first ) {
+        stack.pushList( first, last );
+      }
+      continue;
+    }
+
+    Node * a = stack.pop();
+    Node * b = r % 4 == 0 ? stack.pop() : NULL;
+    if ( a ) {
+      take( a );
+    }
+    if ( b ) {
+      take( b );
+    }
+    if ( r % 64 == 0 ) {
+      sched_yield();
+    }
+    if ( b ) {
+      give( b );
+      stack.pushList( b, b );
+    }
+    if ( a ) {
+      give( a );
+      stack.pushList( a, a );
+    }
+  }
+  return NULL;
+}
+
+int main( int argc, char ** argv ) {
+  int threads = argc > 1 ? atoi( argv[ 1 ] ) : 16;
+  rounds = argc > 2 ? atoi( argv[ 2 ] ) : 200000;
+  if ( threads < 1 || threads > 256 ) {
+    threads = 16;
+  }
+
+  for ( int i = 0; i < Nodes; i++ ) {
+    stack.pushList( &nodes[ i ], &nodes[ i ] );
+  }
+
+  pthread_t ids[ 256 ];
+  for ( int t = 0; t < threads; t++ ) {
+    pthread_create( &ids[ t ], NULL, churn, (void *) (size_t) ( t + 1 ) );
+  }
+  for ( int t = 0; t < threads; t++ ) {
+    pthread_join( ids[ t ], NULL );
+  }
+
+  int left = 0;
+  for ( Node * n = stack.popAll(); n; n = n->_next ) {
+    left++;
+  }
+  if ( errors || left != Nodes ) {
+    printf( "%d nodes popped twice, %d of %d left on the stack\n",
+            errors.load(), left, (int) Nodes );
+    return 1;
+  }
+  printf( "%d threads shared %d nodes through the stack safely!\n",
+          threads, (int) Nodes );
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#define OBJECTS 16
+#define OBJECT_SIZE 40000
+#define MAPPED_SIZE (1024 * 1024)
+
+// Provided by the allocator when it is preloaded
+void checkHeap(void) __attribute__((weak));
+
+static int failed;
+
+static void expect(int ok, const char *what) {
+  if (!ok) {
+    printf("%s\n", what);
+    failed = 1;
+  }
+}
+
+// The size attribute of the first <total type="..."> after from, or -1
+static long total_size(const char *from, const char *type) {
+  char key[64];
+  snprintf(key, sizeof(key), "<total type=\"%s\"", type);
+  const char *p = strstr(from, key);
+  if (p == NULL || (p = strstr(p, "size=\"")) == NULL) {
+    return -1;
+  }
+  return strtol(p + strlen("size=\""), NULL, 10);
+}
+
+// Allocates a known amount and checks that mallinfo2 moves it from free
+// to in use and back, and that malloc_info reports the same totals
+int main() {
+  if (!checkHeap) {
+    printf("Not preloaded, skipped!\n");
+    return 0;
+  }
+
+  // The first round grows the heap, whose segments have some overhead
+  void *ptrs[OBJECTS];
+  void *mapped;
+  struct mallinfo2 before, during;
+  for (int round = 0; round < 2; round++) {
+    before = mallinfo2();
+    for (int i = 0; i < OBJECTS; i++) {
+      ptrs[i] = malloc(OBJECT_SIZE);
+    }
+    mapped = malloc(MAPPED_SIZE);
+    during = mallinfo2();
+    if (round == 0) {
+      free(mapped);
+      for (int i = 0; i < OBJECTS; i++) {
+        free(ptrs[i]);
+      }
+    }
+  }
+
+  // Headers and the buddy heap's rounding to a power of two add at most
+  // as much again
+  size_t used = during.uordblks - before.uordblks;
+  expect(during.uordblks >= before.uordblks &&
+         used >= OBJECTS * OBJECT_SIZE && used <= 2 * OBJECTS * OBJECT_SIZE,
+         "uordblks did not grow by the allocated amount");
+  expect(during.uordblks + during.fordblks == during.arena,
+         "uordblks and fordblks do not add up to arena");
+  expect(during.hblkhd >= MAPPED_SIZE && during.hblks >= 1,
+         "The mapped object is not in hblkhd");
+
+  free(mapped);
+  for (int i = 0; i < OBJECTS; i++) {
+    free(ptrs[i]);
+  }
+  struct mallinfo2 after = mallinfo2();
+  expect(after.uordblks == before.uordblks,
+         "uordblks did not go back after free");
+  expect(after.uordblks + after.fordblks == after.arena,
+         "uordblks and fordblks do not add up to arena after free");
+
+  // Unbuffered, so that writing allocates nothing between the two calls
+  static char xml[65536];
+  FILE *fp = fmemopen(xml, sizeof(xml) - 1, "w");
+  setvbuf(fp, NULL, _IONBF, 0);
+  struct mallinfo2 now = mallinfo2();
+  expect(malloc_info(0, fp) == 0, "malloc_info failed");
+  fclose(fp);
+
+  const char *start = "<malloc version=\"1\">\n";
+  const char *end = "</malloc>\n";
+  size_t length = strlen(xml);
+  expect(strncmp(xml, start, strlen(start)) == 0 && length > strlen(end) &&
+         strcmp(xml + length - strlen(end), end) == 0,
+         "malloc_info is not a <malloc> element");
+  const char *process = strstr(xml, "</heap>");
+  expect(process != NULL, "malloc_info has no <heap> element");
+  if (process) {
+    long fast = total_size(process, "fast");
+    long rest = total_size(process, "rest");
+    long buddy = total_size(process, "buddy");
+    long mmap = total_size(process, "mmap");
+    long cached = total_size(process, "cached");
+    expect(fast >= 0 && rest >= 0 && buddy >= 0 &&
+           (size_t)(fast + rest + buddy) == now.fordblks,
+           "The free totals of malloc_info do not add up to fordblks");
+    expect(mmap >= 0 && cached >= 0 && (size_t)(mmap + cached) == now.hblkhd,
+           "The mapped totals of malloc_info do not add up to hblkhd");
+  }
+
+  errno = 0;
+  expect(malloc_info(1, stdout) == -1 && errno == EINVAL,
+         "malloc_info accepted options");
+
+  checkHeap();
+  if (failed) {
+    return 1;
+  }
+  printf("mallinfo2 and malloc_info counted the allocations!\n");
+  return 0;
+}
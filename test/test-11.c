@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/wait.h>
+
+// Read by the allocator at startup, before MYMALLOC_CONF; needs
+// -rdynamic
+const char *mymalloc_conf = "thread_cache:3m,stats_print:false";
+
+// Provided by the allocator when it is preloaded
+void checkHeap(void) __attribute__((weak));
+
+#define KB 1024L
+#define MB (1024 * KB)
+
+static const struct {
+  const char *env;          // MYMALLOC_CONF, or NULL for none
+  long budget;              // thread_cache in effect
+  const char *warnings[3];  // Expected on stderr, and no others
+} cases[] = {
+  { NULL, 3 * MB, { NULL } },
+  { "thread_cache:5", 5, { NULL } },
+  { "thread_cache:2k", 2 * KB, { NULL } },
+  { "thread_cache:7M", 7 * MB, { NULL } },
+  { "thread_cache:1g", 1024 * MB, { NULL } },
+  { "thread_cache:1m,thread_cache:9k", 9 * KB, { NULL } },
+  { "thread_cache:16e", 3 * MB, { "bad value '16e'" } },
+  { "thread_cache:k", 3 * MB, { "bad value 'k'" } },
+  { "thread_cache:", 3 * MB, { "bad value ''" } },
+  { "thread_cache:99999999999999999999", 3 * MB,
+    { "bad value '99999999999999999999'" } },
+  { "thread_cache:1000000000000g", 3 * MB, { "bad value '1000000000000g'" } },
+  { "Thread_Cache:1k", 3 * MB, { "unknown option 'Thread_Cache'" } },
+  { ",,thread_cache:4k,", 4 * KB,
+    { "option without a value ''", "option without a value ''" } },
+  // Each malformed entry is skipped without stopping the parse
+  { "check,bogus:1,thread_cache:6k,trim_pad:12q", 6 * KB,
+    { "option without a value 'check'", "unknown option 'bogus'",
+      "bad value '12q'" } },
+};
+
+// The thread cache budget from malloc_info, or -1
+static long budget(void) {
+  static char xml[65536];
+  FILE *fp = fmemopen(xml, sizeof(xml) - 1, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  malloc_info(0, fp);
+  fclose(fp);
+  const char *p = strstr(xml, "<total type=\"thread-cache\"");
+  if (p == NULL || (p = strstr(p, "budget=\"")) == NULL) {
+    return -1;
+  }
+  return strtol(p + strlen("budget=\""), NULL, 10);
+}
+
+// Runs this program again with MYMALLOC_CONF set to env, and collects
+// what it writes to stdout and stderr in out
+static int run(const char *env, char *out, size_t size) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], 1);
+    dup2(fds[1], 2);
+    close(fds[0]);
+    if (env) {
+      setenv("MYMALLOC_CONF", env, 1);
+    }
+    else {
+      unsetenv("MYMALLOC_CONF");
+    }
+    execl("/proc/self/exe", "test-11", "report", (char *)NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  size_t length = 0;
+  ssize_t n;
+  while (length < size - 1 &&
+         (n = read(fds[0], out + length, size - 1 - length)) > 0) {
+    length += n;
+  }
+  out[length] = '\0';
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char **argv) {
+  if (!checkHeap) {
+    printf("Not preloaded, skipped!\n");
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "report") == 0) {
+    printf("budget %ld\n", budget());
+    fflush(stdout);
+    _exit(0);
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char out[4096];
+    char expected[64];
+    int status = run(cases[i].env, out, sizeof(out));
+    snprintf(expected, sizeof(expected), "budget %ld\n", cases[i].budget);
+
+    int ok = status == 0 && strstr(out, expected) != NULL;
+    int warnings = 0;
+    for (const char *p = out; (p = strstr(p, "MyMalloc: ")) != NULL; p++) {
+      warnings++;
+    }
+    for (int w = 0; w < 3 && cases[i].warnings[w]; w++) {
+      char warning[128];
+      snprintf(warning, sizeof(warning), "MyMalloc: %s in MYMALLOC_CONF\n",
+               cases[i].warnings[w]);
+      ok &= strstr(out, warning) != NULL;
+      warnings--;
+    }
+    ok &= warnings == 0;
+    if (!ok) {
+      printf("MYMALLOC_CONF=%s: expected %s", cases[i].env ? cases[i].env : "",
+             expected);
+      printf("got:\n%s", out);
+      failed = 1;
+    }
+  }
+
+  if (failed) {
+    return 1;
+  }
+  printf("The configuration strings were parsed as expected!\n");
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+// Read by the allocator at startup; needs -rdynamic. Blocks of the
+// buddy heap have no header to corrupt.
+const char *mymalloc_conf = "buddy:0";
+
+// Provided by the allocator when it is preloaded
+void checkHeap(void) __attribute__((weak));
+void setHeapCheckCallback(void (*callback)(const char *, const void *, void *),
+                          void *arg) __attribute__((weak));
+
+#define SIZE 40000
+
+// A large object's header sits right before it: flags, a magic number
+// and the size including the header and footer. The footer, flags and
+// size, follows the usable bytes.
+#define HEADER_SIZE (2 * sizeof(int) + sizeof(size_t))
+
+static int errors;
+static const void *addresses[16];
+
+static void record(const char *message, const void *address, void *arg) {
+  (void)message;
+  (void)arg;
+  if (errors < 16) {
+    addresses[errors] = address;
+  }
+  errors++;
+}
+
+// Checks the heap and returns whether an error was reported at address
+static int reported_at(const void *address) {
+  errors = 0;
+  checkHeap();
+  for (int i = 0; i < errors && i < 16; i++) {
+    if (addresses[i] == address) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Damages a large object's footer, as an overrun of it would, and the
+// next object's header, as an underrun of that one would. The heap check
+// must report each at the header of the damaged object, and nothing once
+// the bytes are back.
+int main() {
+  if (!checkHeap || !setHeapCheckCallback) {
+    printf("Not preloaded, skipped!\n");
+    return 0;
+  }
+  setHeapCheckCallback(record, NULL);
+
+  char *a = malloc(SIZE);
+  char *b = malloc(SIZE);
+  char *c = malloc(SIZE);
+  int failed = 0;
+  errors = 0;
+  checkHeap();
+  if (errors) {
+    printf("The heap check reported %d errors before any damage\n", errors);
+    failed = 1;
+  }
+
+  char saved[sizeof(size_t)];
+  char *footer = a + malloc_usable_size(a);
+  memcpy(saved, footer, sizeof(saved));
+  memset(footer, 0x5a, sizeof(saved));
+  if (!reported_at(a - HEADER_SIZE)) {
+    printf("An overrun of %p into its footer was not reported there\n", a);
+    failed = 1;
+  }
+  memcpy(footer, saved, sizeof(saved));
+
+  size_t *size = (size_t *)b - 1;
+  size_t good = *size;
+  *size = good + 1;
+  if (!reported_at(b - HEADER_SIZE)) {
+    printf("An underrun of %p into its header was not reported there\n", b);
+    failed = 1;
+  }
+  *size = good;
+
+  errors = 0;
+  checkHeap();
+  if (errors) {
+    printf("The heap check reported %d errors after the repair\n", errors);
+    failed = 1;
+  }
+
+  free(a);
+  free(b);
+  free(c);
+  if (failed) {
+    return 1;
+  }
+  printf("The heap check reported the damaged headers!\n");
+  return 0;
+}
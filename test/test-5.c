@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/wait.h>
+
+#define THREADS 4
+#define FORKS 100
+#define CHILD_ALLOCS 1000
+#define BURST 4096
+
+static volatile int done;
+
+// Keeps the allocator busy, and its lock taken often, while main forks.
+// The bursts of small objects fill slabs and empty them again, so that
+// the threads keep empty slabs in their caches.
+static void *churn(void *arg) {
+  unsigned seed = (unsigned)(size_t)arg;
+  void *ptrs[64] = { 0 };
+  static __thread void *burst[BURST];
+
+  for (int n = 0; !done; n++) {
+    int i = rand_r(&seed) % 64;
+    free(ptrs[i]);
+    ptrs[i] = malloc(rand_r(&seed) % 40000 + 1);
+    if (n % 64 == 0) {
+      for (int j = 0; j < BURST; j++) {
+        burst[j] = malloc(128);
+      }
+      for (int j = 0; j < BURST; j++) {
+        free(burst[j]);
+      }
+    }
+  }
+  for (int i = 0; i < 64; i++) {
+    free(ptrs[i]);
+  }
+  return NULL;
+}
+
+// The bytes of empty slabs the threads may keep, from malloc_info, or -1
+// if the allocator does not report them
+static long thread_cache_bytes(void) {
+  static char xml[65536];
+  FILE *fp = fmemopen(xml, sizeof(xml) - 1, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  malloc_info(0, fp);
+  fclose(fp);
+  const char *key = "<total type=\"thread-cache\" size=\"";
+  char *p = strstr(xml, key);
+  return p ? strtol(p + strlen(key), NULL, 10) : -1;
+}
+
+static void *child_thread(void *arg) {
+  (void)arg;
+  for (int i = 0; i < CHILD_ALLOCS; i++) {
+    free(malloc(i * 16 + 1));
+  }
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[THREADS];
+  int i;
+
+  for (i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, churn, (void *)(size_t)i);
+  }
+  // Give the threads time to fill their caches, if the allocator has them
+  for (i = 0; i < 1000 && thread_cache_bytes() == 0; i++) {
+    usleep(1000);
+  }
+
+  for (i = 0; i < FORKS; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      printf("fork failed!\n");
+      return 1;
+    }
+
+    if (pid == 0) {
+      // Only main survives, and it never gives a slab back, so the
+      // caches of the churn threads must have been reclaimed
+      if (thread_cache_bytes() > 0) {
+        _exit(3);
+      }
+
+      // The child must be able to allocate, both itself and from a new
+      // thread that inherits the heap of a thread that did not survive.
+      void *ptrs[CHILD_ALLOCS];
+      for (int j = 0; j < CHILD_ALLOCS; j++) {
+        ptrs[j] = malloc(j * 8 + 1);
+        if (ptrs[j] == NULL) {
+          _exit(2);
+        }
+        memset(ptrs[j], j, j * 8 + 1);
+      }
+      pthread_t t;
+      pthread_create(&t, NULL, child_thread, NULL);
+      pthread_join(t, NULL);
+      for (int j = 0; j < CHILD_ALLOCS; j++) {
+        free(ptrs[j]);
+      }
+      _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+      status = -1;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 3) {
+      printf("Child %d kept the caches of the threads that did not survive "
+             "fork!\n", i);
+      return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("Child %d failed to allocate after fork!\n", i);
+      return 1;
+    }
+  }
+
+  done = 1;
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("Memory was allocated after %d forks!\n", FORKS);
+  return 0;
+}
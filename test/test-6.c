@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Objects that one thread frees from another thread's slabs must go back
+// to the owner: a third thread that allocates afterwards must never get
+// an object on a cache line the owner still uses.
+
+#define OBJECTS 4096
+#define SIZE 48
+#define LINE 64
+
+static void *objects[OBJECTS];
+static void *taken[OBJECTS];
+
+static void *free_odd(void *arg) {
+  (void)arg;
+  free(malloc(SIZE));
+  for (int i = 1; i < OBJECTS; i += 2) {
+    free(objects[i]);
+  }
+  return NULL;
+}
+
+static void *allocate(void *arg) {
+  (void)arg;
+  for (int i = 0; i < OBJECTS / 2; i++) {
+    taken[i] = malloc(SIZE);
+  }
+  return NULL;
+}
+
+static int shares_line(void *a, void *b) {
+  uintptr_t x = (uintptr_t)a, y = (uintptr_t)b;
+  return x / LINE <= (y + SIZE - 1) / LINE && y / LINE <= (x + SIZE - 1) / LINE;
+}
+
+static int compare(const void *a, const void *b) {
+  uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main() {
+  pthread_t thread;
+  uintptr_t live[OBJECTS / 2];
+  int shared = 0;
+
+  for (int i = 0; i < OBJECTS; i++) {
+    objects[i] = malloc(SIZE);
+  }
+  pthread_create(&thread, NULL, free_odd, NULL);
+  pthread_join(thread, NULL);
+  pthread_create(&thread, NULL, allocate, NULL);
+  pthread_join(thread, NULL);
+
+  for (int i = 0; i < OBJECTS / 2; i++) {
+    live[i] = (uintptr_t)objects[2 * i];
+  }
+  qsort(live, OBJECTS / 2, sizeof(uintptr_t), compare);
+
+  // The live objects closest to each taken one are the only candidates
+  for (int i = 0; i < OBJECTS / 2; i++) {
+    int lo = 0, hi = OBJECTS / 2;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (live[mid] < (uintptr_t)taken[i]) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if ((lo < OBJECTS / 2 && shares_line((void *)live[lo], taken[i])) ||
+        (lo > 0 && shares_line((void *)live[lo - 1], taken[i]))) {
+      shared++;
+    }
+  }
+
+  if (shared) {
+    printf("%d of %d objects share a cache line with another thread's\n",
+           shared, OBJECTS / 2);
+    exit(1);
+  }
+  printf("No object shares a cache line with another thread's!\n");
+  return 0;
+}
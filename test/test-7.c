@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#define SLOTS 64
+#define ROUNDS 200000
+
+// Provided by the allocator when it is preloaded
+size_t checkHeapIncremental(size_t maxObjects) __attribute__((weak));
+void setHeapCheckCallback(void (*callback)(const char *, const void *, void *),
+                          void *arg) __attribute__((weak));
+
+static void report(const char *message, const void *address, void *arg) {
+  (void)arg;
+  printf("%s at %p\n", message, address);
+}
+
+// Shrinks the top of the heap with free and malloc_trim while an
+// incremental heap check is in progress, which must not make the check
+// look past the new end of the heap
+int main() {
+  if (!checkHeapIncremental || !setHeapCheckCallback) {
+    printf("No incremental heap check, skipped!\n");
+    return 0;
+  }
+  setHeapCheckCallback(report, NULL);
+
+  unsigned seed = 1;
+  void *ptrs[SLOTS] = { 0 };
+  size_t errors = 0;
+  for (int i = 0; i < ROUNDS && errors == 0; i++) {
+    int slot = rand_r(&seed) % SLOTS;
+    free(ptrs[slot]);
+    ptrs[slot] = NULL;
+    if (rand_r(&seed) % 2) {
+      ptrs[slot] = malloc(rand_r(&seed) % 60000 + 20000);
+    }
+    if (rand_r(&seed) % 8 == 0) {
+      malloc_trim(0);
+    }
+    errors += checkHeapIncremental(rand_r(&seed) % 4 + 1);
+  }
+  for (int i = 0; i < SLOTS; i++) {
+    free(ptrs[i]);
+  }
+  malloc_trim(0);
+  errors += checkHeapIncremental(1000000);
+
+  if (errors) {
+    printf("%zu heap check errors after a trim\n", errors);
+    return 1;
+  }
+  printf("The heap checks stayed clean across trims!\n");
+  return 0;
+}
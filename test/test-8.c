@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+// Many threads swap objects of every size class, and now and then a
+// large one, through a shared array, so most frees are remote. Waves of
+// short-lived threads meanwhile create, abandon and adopt heaps. Each
+// object carries its address and size at both ends, which another owner
+// of the same memory would overwrite.
+
+#define WORKERS 32
+#define ROUNDS 40000
+#define WAVES 100
+#define WAVE_THREADS 8
+#define WAVE_ROUNDS 2000
+#define SLOTS 4096
+
+static void *slots[SLOTS];
+static int corrupt;
+
+static size_t pick_size(unsigned *seed) {
+  unsigned r = rand_r(seed);
+  if (r % 256 == 0) {
+    return 16384 + r % (600 * 1024);
+  }
+  return 1 + (r >> 8) % 16384;
+}
+
+static void stamp(uintptr_t *p, size_t size) {
+  p[0] = (uintptr_t)p;
+  p[1] = size;
+  memcpy((char *)p + size - sizeof(uintptr_t), &p[0], sizeof(uintptr_t));
+}
+
+static void verify(uintptr_t *p) {
+  size_t size = p[1];
+  uintptr_t tail;
+  memcpy(&tail, (char *)p + size - sizeof(uintptr_t), sizeof(uintptr_t));
+  if (p[0] != (uintptr_t)p || tail != (uintptr_t)p) {
+    __atomic_store_n(&corrupt, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void swap(unsigned *seed, int rounds) {
+  for (int i = 0; i < rounds && !__atomic_load_n(&corrupt, __ATOMIC_RELAXED);
+       i++) {
+    size_t size = pick_size(seed);
+    if (size < 3 * sizeof(uintptr_t)) {
+      size = 3 * sizeof(uintptr_t);
+    }
+    uintptr_t *p = malloc(size);
+    if (p == NULL) {
+      __atomic_store_n(&corrupt, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    stamp(p, size);
+    int slot = rand_r(seed) % SLOTS;
+    uintptr_t *old = __atomic_exchange_n(&slots[slot], p, __ATOMIC_ACQ_REL);
+    if (old) {
+      verify(old);
+      free(old);
+    }
+  }
+}
+
+static void *worker(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  swap(&seed, ROUNDS);
+  return NULL;
+}
+
+static void *short_lived(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  swap(&seed, WAVE_ROUNDS);
+  return NULL;
+}
+
+static void *spawner(void *arg) {
+  (void)arg;
+  for (int w = 0; w < WAVES; w++) {
+    pthread_t threads[WAVE_THREADS];
+    for (int t = 0; t < WAVE_THREADS; t++) {
+      pthread_create(&threads[t], NULL, short_lived,
+                     (void *)(uintptr_t)(1000 + w * WAVE_THREADS + t));
+    }
+    for (int t = 0; t < WAVE_THREADS; t++) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[WORKERS + 1];
+  for (int t = 0; t < WORKERS; t++) {
+    pthread_create(&threads[t], NULL, worker, (void *)(uintptr_t)(t + 1));
+  }
+  pthread_create(&threads[WORKERS], NULL, spawner, NULL);
+  for (int t = 0; t <= WORKERS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  for (int i = 0; i < SLOTS; i++) {
+    if (slots[i]) {
+      verify(slots[i]);
+      free(slots[i]);
+    }
+  }
+  if (corrupt) {
+    printf("An object was handed out twice or overwritten!\n");
+    return 1;
+  }
+  printf("%d threads and %d short-lived ones swapped objects safely!\n",
+         WORKERS, WAVES * WAVE_THREADS);
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Free objects of 256 KB or more are indexed by size, and requests that
+// large take the smallest one that fits whatever the placement. With
+// first fit from the newest chunk, the list alone would hand out the
+// chunk freed last instead.
+
+// Read by the allocator at startup; needs -rdynamic. The large sizes
+// only reach the heap with a raised mmap threshold.
+const char *mymalloc_conf =
+  "mmap_threshold:64m,trim_threshold:1g,placement:first,buddy:0";
+
+// Provided by the allocator when it is preloaded
+void checkHeap(void) __attribute__((weak));
+
+#define KB 1024
+
+// Frees chunks of three sizes, each followed by a separator that keeps
+// them apart, and checks that a request just below the middle size gets
+// the middle chunk. They are all carved in order from one free chunk,
+// the newest, so that nothing else lands between them.
+static int smallest_fit(size_t unit) {
+  size_t sizes[3] = { 400 * unit, 300 * unit, 350 * unit };
+  char *chunks[3];
+  char *separators[3];
+  free(malloc(2000 * unit));
+  for (int i = 0; i < 3; i++) {
+    chunks[i] = malloc(sizes[i]);
+    separators[i] = malloc(200 * unit);
+  }
+  for (int i = 0; i < 3; i++) {
+    free(chunks[i]);
+  }
+
+  char *p = malloc(290 * unit);
+  int ok = p >= chunks[1] && p < chunks[1] + sizes[1];
+  if (!ok) {
+    printf("A %zu KB request did not get the smallest free chunk that fits\n",
+           290 * unit / KB);
+  }
+
+  free(p);
+  for (int i = 0; i < 3; i++) {
+    free(separators[i]);
+  }
+  return ok;
+}
+
+int main() {
+  if (!checkHeap) {
+    printf("Not preloaded, skipped!\n");
+    return 0;
+  }
+  // Below the default mmap threshold, and above it
+  int ok = smallest_fit(KB);
+  ok &= smallest_fit(4 * KB);
+  checkHeap();
+  if (!ok) {
+    return 1;
+  }
+  printf("Large requests took the smallest free chunk that fits!\n");
+  return 0;
+}
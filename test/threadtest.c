@@ -0,0 +1,51 @@
+// Hoard's threadtest. Every thread repeatedly allocates a batch of
+// objects and then frees all of them; nothing is shared between threads,
+// so an allocator that scales should run N threads as fast as one.
+//
+// Usage: ./threadtest threads [iterations] [objects] [size]
+
+#include "bench.h"
+
+static int iterations;
+static int nobjects;
+static int object_size;
+
+static void *threadtest_thread(void *arg) {
+  (void)arg;
+  void **objects = malloc(nobjects * sizeof(void *));
+
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < nobjects; j++) {
+      char *p = malloc(object_size);
+      p[0] = (char)j;
+      objects[j] = p;
+    }
+    for (int j = 0; j < nobjects; j++) {
+      free(objects[j]);
+    }
+  }
+
+  free(objects);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nthreads = bench_threads(argc, argv);
+  iterations = argc > 2 ? atoi(argv[2]) : 50;
+  nobjects = (argc > 3 ? atoi(argv[3]) : 100000) / nthreads;
+  object_size = argc > 4 ? atoi(argv[4]) : 8;
+
+  pthread_t threads[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, threadtest_thread, NULL);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("threadtest", nthreads,
+               2ull * iterations * nobjects * nthreads, elapsed);
+  return 0;
+}
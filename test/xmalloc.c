@@ -0,0 +1,122 @@
+// xmalloc-test: producer/consumer pairs. Producers allocate batches of
+// objects and pass them through a shared queue to consumers, which free
+// them. Every free is therefore a cross-thread free.
+//
+// Usage: ./xmalloc threads [seconds] [size]
+// threads is the number of producer/consumer pairs.
+
+#include "bench.h"
+
+#define BATCH 256
+#define QUEUE 64
+
+struct batch {
+  void *objects[BATCH];
+};
+
+static struct batch *queue[QUEUE];
+static int head, tail, count;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+
+static volatile int stop;
+static int object_size;
+static uint64_t total_ops;
+
+static void enqueue(struct batch *b) {
+  pthread_mutex_lock(&queue_lock);
+  while (count == QUEUE) {
+    pthread_cond_wait(&not_full, &queue_lock);
+  }
+  queue[tail] = b;
+  tail = (tail + 1) % QUEUE;
+  count++;
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+// Returns NULL once the producers are done and the queue is drained.
+static struct batch *dequeue() {
+  pthread_mutex_lock(&queue_lock);
+  while (count == 0 && !stop) {
+    pthread_cond_wait(&not_empty, &queue_lock);
+  }
+  struct batch *b = NULL;
+  if (count > 0) {
+    b = queue[head];
+    head = (head + 1) % QUEUE;
+    count--;
+    pthread_cond_signal(&not_full);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return b;
+}
+
+static void *producer(void *arg) {
+  (void)arg;
+  uint64_t ops = 0;
+  while (!stop) {
+    struct batch *b = malloc(sizeof(struct batch));
+    for (int i = 0; i < BATCH; i++) {
+      char *p = malloc(object_size);
+      p[0] = (char)i;
+      b->objects[i] = p;
+    }
+    ops += BATCH + 1;
+    enqueue(b);
+  }
+  __atomic_add_fetch(&total_ops, ops, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  (void)arg;
+  uint64_t ops = 0;
+  struct batch *b;
+  while ((b = dequeue()) != NULL) {
+    for (int i = 0; i < BATCH; i++) {
+      free(b->objects[i]);
+    }
+    free(b);
+    ops += BATCH + 1;
+  }
+  __atomic_add_fetch(&total_ops, ops, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int npairs = bench_threads(argc, argv);
+  int seconds = argc > 2 ? atoi(argv[2]) : 2;
+  object_size = argc > 3 ? atoi(argv[3]) : 64;
+
+  pthread_t producers[MAX_THREADS], consumers[MAX_THREADS];
+  uint64_t start = bench_now_ns();
+  for (int t = 0; t < npairs; t++) {
+    pthread_create(&producers[t], NULL, producer, NULL);
+    pthread_create(&consumers[t], NULL, consumer, NULL);
+  }
+
+  sleep(seconds);
+  stop = 1;
+
+  // Producers may be blocked on a full queue; keep waking everybody until
+  // they have all seen the stop flag.
+  for (int t = 0; t < npairs; t++) {
+    pthread_mutex_lock(&queue_lock);
+    pthread_cond_broadcast(&not_full);
+    pthread_cond_broadcast(&not_empty);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(producers[t], NULL);
+  }
+  pthread_mutex_lock(&queue_lock);
+  pthread_cond_broadcast(&not_empty);
+  pthread_mutex_unlock(&queue_lock);
+  for (int t = 0; t < npairs; t++) {
+    pthread_join(consumers[t], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_report("xmalloc", npairs, total_ops, elapsed);
+  return 0;
+}